@@ -0,0 +1,89 @@
+#include "autotune.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+std::vector<TreeConfig> treeConfigs()
+{
+  std::vector<TreeConfig> configs;
+  for (int leafSize : QuadTreeLeafSizes)
+    for (int fanOut : QuadTreeFanOuts) {
+      TreeConfig config;
+      config.leafSize = leafSize;
+      config.fanOut = fanOut;
+      configs.push_back(config);
+    }
+  return configs;
+}
+
+std::string sceneSignature(const std::vector<Particle>& particles,
+                           float cullRadius, int numRanks, int numThreads,
+                           const std::string& engine)
+{
+  const int cells = 16;
+  int clustering = 0;
+  if (!particles.empty()) {
+    Vec2 bmin, bmax;
+    computeBounds(particles, bmin, bmax);
+    Vec2 extent = bmax - bmin;
+    std::vector<uint32_t> counts(cells * cells, 0);
+    uint32_t peak = 0;
+    for (auto& p : particles) {
+      int x = extent.x > 0.0f ? (int)((p.position.x - bmin.x) / extent.x * cells) : 0;
+      int y = extent.y > 0.0f ? (int)((p.position.y - bmin.y) / extent.y * cells) : 0;
+      x = x < 0 ? 0 : x >= cells ? cells - 1 : x;
+      y = y < 0 ? 0 : y >= cells ? cells - 1 : y;
+      uint32_t count = ++counts[y * cells + x];
+      if (count > peak)
+        peak = count;
+    }
+    double mean = (double)particles.size() / (cells * cells);
+    clustering = (int)floor(log2(peak / mean));
+  }
+  char signature[256];
+  snprintf(signature, sizeof(signature),
+           "n=%zu cull=%g clustering=%d ranks=%d threads=%d %s",
+           particles.size(), cullRadius, clustering, numRanks, numThreads,
+           engine.c_str());
+  return signature;
+}
+
+bool findTreeConfig(const std::string& cacheFile, const std::string& signature,
+                    TreeConfig& config)
+{
+  FILE* file = fopen(cacheFile.c_str(), "r");
+  if (!file)
+    return false;
+  bool found = false;
+  char line[512];
+  while (fgets(line, sizeof(line), file)) {
+    char* tab = strchr(line, '\t');
+    if (!tab || (size_t)(tab - line) != signature.size() ||
+        signature.compare(0, signature.size(), line, tab - line) != 0)
+      continue;
+    int leafSize = 0, fanOut = 0;
+    if (sscanf(tab + 1, "%d\t%d", &leafSize, &fanOut) == 2 &&
+        isQuadTreeLeafSize(leafSize) && (fanOut == 4 || fanOut == 16)) {
+      config.leafSize = leafSize;
+      config.fanOut = fanOut;
+      found = true;
+    }
+  }
+  fclose(file);
+  return found;
+}
+
+bool saveTreeConfig(const std::string& cacheFile, const std::string& signature,
+                    const TreeConfig& config)
+{
+  FILE* file = fopen(cacheFile.c_str(), "a");
+  if (!file) {
+    fprintf(stderr, "error writing file \"%s\"\n", cacheFile.c_str());
+    return false;
+  }
+  fprintf(file, "%s\t%d\t%d\n", signature.c_str(), config.leafSize,
+          config.fanOut);
+  fclose(file);
+  return true;
+}
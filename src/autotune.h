@@ -0,0 +1,44 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <string>
+#include <vector>
+#include "common.h"
+#include "quad-tree.h"
+
+// The tree configurations -autotune chooses from, and the cache of its
+// choices.
+//
+// Leaf size and fan-out only change which nodes a query visits, not which
+// particles within cullRadius it finds or their order, so every
+// configuration gives the same result and only its speed is tuned.
+//
+// The cache is a text file with one line per scene signature: the
+// signature, the leaf size and the fan-out, separated by tabs. Later lines
+// override earlier ones, so new choices are appended.
+
+struct TreeConfig
+{
+    int leafSize = DefaultQuadTreeLeafSize;
+    int fanOut = 4;
+};
+
+// every leaf size with every fan-out
+std::vector<TreeConfig> treeConfigs();
+
+// Describes what the speed of the configurations depends on: the particle
+// count, the cull radius, how clustered the particles are, the ranks and
+// threads, and the engine, e.g. the tree builder. Clustering is the peak
+// to mean particle count of a 16 x 16 grid over the bounds, in powers of 2.
+std::string sceneSignature(const std::vector<Particle>& particles,
+                           float cullRadius, int numRanks, int numThreads,
+                           const std::string& engine);
+
+// Finds the configuration cached for signature; false if there is none or
+// the file does not exist.
+bool findTreeConfig(const std::string& cacheFile, const std::string& signature,
+                    TreeConfig& config);
+bool saveTreeConfig(const std::string& cacheFile, const std::string& signature,
+                    const TreeConfig& config);
+
+#endif
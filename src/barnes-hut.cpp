@@ -0,0 +1,66 @@
+#include "barnes-hut.h"
+#include <algorithm>
+#include "force-kernel.h"
+#include "thread-pool.h"
+#include "trace.h"
+
+// particles per chunk of the force loop, as in simulateStep
+const uint32_t BarnesHutChunkSize = 256;
+
+void simulateStepBarnesHut(const QuadTree& tree,
+                           const std::vector<Particle>& particles,
+                           std::vector<Particle>& newParticles,
+                           StepParameters params, float theta,
+                           ThreadPool* pool, uint32_t* interactions)
+{
+  parallelFor(pool, (uint32_t)particles.size(), [&](uint32_t begin, uint32_t end) {
+    TraceSpan span("force chunk");
+    // the approximated nodes of one particle, gathered for the force kernel
+    static thread_local std::vector<float> positionX, positionY, mass;
+    for (uint32_t i = begin; i < end; ++i) {
+      const auto& pi = particles[i];
+      Vec2 force = Vec2(0.0f, 0.0f);
+      uint32_t candidates = 0;
+      positionX.clear();
+      positionY.clear();
+      mass.clear();
+      tree.forEachBarnesHut(pi.position, params.cullRadius, theta,
+                            [&](uint32_t spanBegin, uint32_t spanEnd) {
+        accumulateForce(pi, tree.particlesSoA, spanBegin, spanEnd,
+                        params.cullRadius, force);
+        candidates += spanEnd - spanBegin;
+        COUNT(spans, 1);
+      }, [&](const NodeMoments& node) {
+        positionX.push_back(node.center.x);
+        positionY.push_back(node.center.y);
+        mass.push_back(node.mass);
+      });
+      accumulateForce(pi, positionX.data(), positionY.data(), mass.data(),
+                      (uint32_t)mass.size(), params.cullRadius, force);
+      candidates += (uint32_t)mass.size();
+      COUNT(queries, 1);
+      COUNT(candidates, candidates);
+      COUNT_BIN(candidatesPerQuery, candidateBin(candidates));
+      if (interactions)
+        interactions[i] = candidates;
+      newParticles[i] = updateParticle(pi, force, params.deltaTime);
+    }
+  }, BarnesHutChunkSize);
+}
+
+void ForceError::add(const std::vector<Particle>& particles,
+                     const std::vector<Particle>& approximate,
+                     const std::vector<Particle>& exact)
+{
+  for (size_t i = 0; i < particles.size(); i++) {
+    Vec2 exactChange = exact[i].velocity - particles[i].velocity;
+    double exactLength = exactChange.length();
+    if (exactLength == 0.0)
+      continue;
+    double error = (approximate[i].velocity - exact[i].velocity).length() /
+                   exactLength;
+    sumSquared += error * error;
+    max = std::max(max, error);
+    count++;
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef BARNES_HUT_H
+#define BARNES_HUT_H
+
+#include <cstdint>
+#include <vector>
+#include "common.h"
+#include "quad-tree.h"
+
+class ThreadPool;
+
+// Barnes-Hut approximation of the forces: nodes of the tree far enough
+// from a particle, relative to their width, act on it as one particle of
+// their total mass at their center of mass. Theta bounds width / distance
+// of the approximated nodes; larger values approximate more nodes and
+// lose more accuracy. See QuadTree::forEachBarnesHut for which nodes
+// qualify. The exact forces of simulateStep remain the default.
+
+// Same as simulateStep over tree, with the forces of the approximated
+// nodes added after those of the particles. tree.computeMoments must
+// have been called after the last build. If interactions is not null,
+// interactions[i] receives the number of particles and nodes evaluated for
+// particles[i].
+void simulateStepBarnesHut(const QuadTree& tree,
+                           const std::vector<Particle>& particles,
+                           std::vector<Particle>& newParticles,
+                           StepParameters params, float theta,
+                           ThreadPool* pool,
+                           uint32_t* interactions = nullptr);
+
+// Error of approximate forces against exact ones, measured by the velocity
+// change of a step, which is the force times deltaTime / mass. Particles
+// the exact step does not accelerate are skipped.
+struct ForceError
+{
+    double sumSquared = 0.0;
+    double max = 0.0;
+    long long count = 0;
+
+    // adds the relative errors of approximate against exact, both stepped
+    // from particles
+    void add(const std::vector<Particle>& particles,
+             const std::vector<Particle>& approximate,
+             const std::vector<Particle>& exact);
+    double rms() const { return count > 0 ? sqrt(sumSquared / count) : 0.0; }
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include "checkpoint.h"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "snapshot.h"
+#include "timing.h"
+#include "trace.h"
+
+// the snapshot starts aligned, so its blocks are aligned in the file too
+const uint64_t CheckpointAlignment = 64;
+
+bool loadCheckpoint(const std::string& fileName, CheckpointState& state,
+                    std::vector<Particle>& particles)
+{
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "error reading file \"" << fileName << "\"" << std::endl;
+    return false;
+  }
+  struct stat info;
+  std::vector<char> buffer;
+  bool ok = fstat(fd, &info) == 0;
+  if (ok)
+    buffer.resize((size_t)info.st_size);
+  for (size_t done = 0; ok && done < buffer.size();) {
+    // read may return early for large files
+    ssize_t count = read(fd, buffer.data() + done, buffer.size() - done);
+    ok = count > 0;
+    done += ok ? (size_t)count : 0;
+  }
+  close(fd);
+  if (!ok) {
+    std::cerr << "error reading file \"" << fileName << "\"" << std::endl;
+    return false;
+  }
+
+  CheckpointHeader header;
+  bool valid = buffer.size() >= sizeof(header);
+  if (valid) {
+    memcpy(&header, buffer.data(), sizeof(header));
+    valid = memcmp(header.magic, CheckpointMagic, sizeof(CheckpointMagic)) == 0 &&
+            header.byteOrder == SnapshotByteOrder &&
+            header.version == CheckpointVersion &&
+            // checked so that a corrupt offset or size cannot overflow
+            header.snapshotOffset <= buffer.size() &&
+            header.snapshotSize <= buffer.size() - header.snapshotOffset &&
+            header.snapshotOffset % CheckpointAlignment == 0 &&
+            readSnapshot(buffer.data() + header.snapshotOffset,
+                         header.snapshotSize, particles) &&
+            particles.size() == header.state.numParticles;
+  }
+  if (!valid) {
+    std::cerr << "\"" << fileName << "\" is not a supported checkpoint" << std::endl;
+    return false;
+  }
+  state = header.state;
+  state.inputFile[sizeof(state.inputFile) - 1] = '\0';
+  return true;
+}
+
+bool saveCheckpoint(const std::string& fileName, const CheckpointState& state,
+                    const std::vector<Particle>& particles)
+{
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CheckpointMagic, sizeof(CheckpointMagic));
+  header.version = CheckpointVersion;
+  header.byteOrder = SnapshotByteOrder;
+  header.state = state;
+  header.snapshotOffset = (sizeof(header) + CheckpointAlignment - 1) /
+                          CheckpointAlignment * CheckpointAlignment;
+  std::vector<char> buffer(header.snapshotOffset, 0);
+  appendSnapshot(particles, buffer);
+  header.snapshotSize = buffer.size() - header.snapshotOffset;
+  memcpy(buffer.data(), &header, sizeof(header));
+
+  // a crash leaves at most a partial temporary file, never a partial
+  // checkpoint
+  std::string tempName = fileName + ".tmp";
+  int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0;
+  for (size_t written = 0; ok && written < buffer.size();) {
+    ssize_t count = write(fd, buffer.data() + written, buffer.size() - written);
+    ok = count > 0;
+    written += ok ? (size_t)count : 0;
+  }
+  if (fd >= 0) {
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+  }
+  ok = ok && rename(tempName.c_str(), fileName.c_str()) == 0;
+  if (!ok)
+    std::cerr << "error writing file \"" << fileName << "\"" << std::endl;
+  return ok;
+}
+
+CheckpointWriter::CheckpointWriter()
+  : thread(&CheckpointWriter::workerLoop, this)
+{
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+  finish();
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    stopping = true;
+  }
+  checkpointQueued.notify_all();
+  thread.join();
+}
+
+double CheckpointWriter::queue(const std::string& fileName,
+                               const CheckpointState& state,
+                               const std::vector<Particle>& particles)
+{
+  TraceSpan span("checkpoint queue");
+  std::unique_lock<std::mutex> guard(mutex);
+  double waited = 0.0;
+  if (pending) {
+    Timer t;
+    checkpointDone.wait(guard, [&] { return !pending; });
+    waited = t.elapsed();
+    stalls++;
+    stallTime += waited;
+  }
+  this->fileName = fileName;
+  this->state = state;
+  this->particles.assign(particles.begin(), particles.end());
+  pending = true;
+  guard.unlock();
+  checkpointQueued.notify_one();
+  return waited;
+}
+
+void CheckpointWriter::finish()
+{
+  std::unique_lock<std::mutex> guard(mutex);
+  checkpointDone.wait(guard, [&] { return !pending; });
+}
+
+void CheckpointWriter::workerLoop()
+{
+  setTraceThreadName("checkpoint writer");
+  std::unique_lock<std::mutex> guard(mutex);
+  for (;;) {
+    checkpointQueued.wait(guard, [&] { return stopping || pending; });
+    if (!pending)
+      return;
+    // queue waits while pending, so the copy is ours until then
+    guard.unlock();
+    Timer t;
+    bool ok;
+    {
+      TraceSpan span("checkpoint write");
+      ok = saveCheckpoint(fileName, state, particles);
+    }
+    double seconds = t.elapsed();
+    guard.lock();
+    (ok ? written : failures)++;
+    writeTime += seconds;
+    pending = false;
+    checkpointDone.notify_all();
+  }
+}
@@ -0,0 +1,112 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common.h"
+
+// Checkpoints of -checkpoint-every, resumed with -restart. The file is a
+// CheckpointHeader with the state of the run, followed at snapshotOffset
+// by the particles in the snapshot format of snapshot.h, sorted by id.
+//
+// Everything the result depends on is in the file: the particles after
+// iteration iterations, the step parameters, the slack bounds of the
+// incremental tree and the leaf size, which Barnes-Hut nodes depend on.
+// The scene, seed and input file are kept to describe the run. The domain
+// split, the particle order and the fan-out do not change the result, so
+// a run may resume with other ranks and threads. Verlet lists are not
+// saved; the lists are rebuilt right after every checkpoint instead, so
+// the run that wrote it rebuilds them where the resumed one does. With
+// -verlet-skin the rebuilds change the summation order, so a resumed run
+// matches only an uninterrupted run with the same -checkpoint-every, not
+// one without checkpoints.
+//
+// Checkpoints are read by a writer of the same byte order only.
+
+const char CheckpointMagic[8] = { 'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P' };
+const uint32_t CheckpointVersion = 1;
+
+// Plain data, so headers can be zeroed and copied as bytes; value
+// initialize it, CheckpointState(), to start from zeros.
+struct CheckpointState
+{
+    // iterations completed; the resumed run starts with this one
+    uint64_t iteration;
+    uint64_t numParticles;
+    float deltaTime;
+    float cullRadius;
+    float spaceSize;
+    uint32_t scene;
+    uint64_t seed;
+    // slack bounds of the incremental tree, if treeBoundsSet
+    uint32_t treeBoundsSet;
+    float treeBMin[2];
+    float treeBMax[2];
+    uint32_t leafSize;
+    uint32_t fanOut;
+    // empty for generated scenes
+    char inputFile[256];
+};
+
+struct CheckpointHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    CheckpointState state;
+    uint64_t snapshotOffset;
+    uint64_t snapshotSize;
+};
+
+// Reads the whole file into state and particles; false, with a message,
+// if it cannot be read or is not a checkpoint.
+bool loadCheckpoint(const std::string& fileName, CheckpointState& state,
+                    std::vector<Particle>& particles);
+
+// Writes the file to fileName.tmp, syncs it and renames it over fileName,
+// so fileName always holds a complete checkpoint.
+bool saveCheckpoint(const std::string& fileName, const CheckpointState& state,
+                    const std::vector<Particle>& particles);
+
+// Saves checkpoints with saveCheckpoint on a background thread. queue
+// copies the particles, which is all the step loop waits for unless the
+// previous checkpoint is still being written; that wait is a stall.
+class CheckpointWriter
+{
+public:
+    CheckpointWriter();
+    // waits for the queued checkpoint to be written
+    ~CheckpointWriter();
+
+    // Returns the seconds spent waiting for the previous checkpoint.
+    double queue(const std::string& fileName, const CheckpointState& state,
+                 const std::vector<Particle>& particles);
+
+    // Blocks until the queued checkpoint has been written.
+    void finish();
+
+    int written = 0;
+    int failures = 0;
+    int stalls = 0;
+    double stallTime = 0.0;
+    // seconds the background thread spent writing
+    double writeTime = 0.0;
+
+private:
+    void workerLoop();
+
+    std::string fileName;
+    CheckpointState state;
+    std::vector<Particle> particles;
+    bool pending = false;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable checkpointQueued, checkpointDone;
+    std::thread thread;
+};
+
+#endif
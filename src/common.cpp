@@ -7,6 +7,8 @@
 #include <iomanip>
 #include "common.h"
 #include "quad-tree.h"
+#include "snapshot.h"
+#include "text-format.h"
 
 std::string removeQuote(std::string input)
 {
@@ -23,6 +25,28 @@ StepParameters getBenchmarkStepParams(float spaceSize)
   return result;
 }
 
+StepParameters getStepParams(const StartupOptions& options)
+{
+  StepParameters result = getBenchmarkStepParams(options.spaceSize);
+  if (options.cullRadius > 0.0f)
+    result.cullRadius = options.cullRadius;
+  if (options.deltaTime > 0.0f)
+    result.deltaTime = options.deltaTime;
+  return result;
+}
+
+void computeBounds(const std::vector<Particle>& particles, Vec2& bmin, Vec2& bmax)
+{
+  bmin = Vec2(1e30f, 1e30f);
+  bmax = Vec2(-1e30f, -1e30f);
+
+  for (auto &p : particles){
+    bmin.x = fminf(bmin.x, p.position.x);
+    bmin.y = fminf(bmin.y, p.position.y);
+    bmax.x = fmaxf(bmax.x, p.position.x);
+    bmax.y = fmaxf(bmax.y, p.position.y);
+  }
+}
 
 StartupOptions parseOptions(int argc, char *argv[])
 {
@@ -35,10 +59,16 @@ StartupOptions parseOptions(int argc, char *argv[])
                 rs.numIterations = atoi(argv[i + 1]);
             else if (strcmp(argv[i], "-s") == 0)
                 rs.spaceSize = (float)atof(argv[i + 1]);
+            else if (strcmp(argv[i], "-cull") == 0)
+                rs.cullRadius = (float)atof(argv[i + 1]);
+            else if (strcmp(argv[i], "-dt") == 0)
+                rs.deltaTime = (float)atof(argv[i + 1]);
             else if (strcmp(argv[i], "-in") == 0)
                 rs.inputFile = removeQuote(argv[i + 1]);
             else if (strcmp(argv[i], "-n") == 0)
                 rs.numParticles = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-t") == 0)
+                rs.numThreads = atoi(argv[i + 1]);
             else if (strcmp(argv[i], "-v") == 0)
                 rs.viewportRadius = (float)atof(argv[i + 1]);
             else if (strcmp(argv[i], "-o") == 0)
@@ -50,6 +80,87 @@ StartupOptions parseOptions(int argc, char *argv[])
             }
             else if (strcmp(argv[i], "-ref") == 0)
                 rs.referenceAnswerDir = removeQuote(argv[i + 1]);
+            else if (strcmp(argv[i], "-kernel") == 0)
+            {
+                if (strcmp(argv[i + 1], "scalar") == 0)
+                    rs.forceKernel = ForceKernelType::Scalar;
+                else if (strcmp(argv[i + 1], "avx2") == 0)
+                    rs.forceKernel = ForceKernelType::AVX2;
+                else if (strcmp(argv[i + 1], "avx512") == 0)
+                    rs.forceKernel = ForceKernelType::AVX512;
+                else
+                    rs.forceKernel = ForceKernelType::Auto;
+            }
+            else if (strcmp(argv[i], "-index") == 0)
+            {
+                if (strcmp(argv[i + 1], "grid") == 0)
+                    rs.spatialIndex = SpatialIndexType::UniformGrid;
+                else
+                    rs.spatialIndex = SpatialIndexType::QuadTree;
+            }
+            else if (strcmp(argv[i], "-grid-cells") == 0)
+                rs.gridCellsPerRadius = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-lb-interval") == 0)
+                rs.loadBalanceInterval = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-lb-threshold") == 0)
+                rs.loadBalanceThreshold = (float)atof(argv[i + 1]);
+            else if (strcmp(argv[i], "-tree-update") == 0)
+                rs.incrementalTree = strcmp(argv[i + 1], "incremental") == 0;
+            else if (strcmp(argv[i], "-tree-slack") == 0)
+                rs.treeSlack = (float)atof(argv[i + 1]);
+            else if (strcmp(argv[i], "-leaf-size") == 0)
+                rs.leafSize = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-fan-out") == 0)
+                rs.fanOut = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-reorder") == 0)
+                rs.reorderInterval = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-reorder-threshold") == 0)
+                rs.reorderThreshold = (float)atof(argv[i + 1]);
+            else if (strcmp(argv[i], "-theta") == 0)
+                rs.theta = (float)atof(argv[i + 1]);
+            else if (strcmp(argv[i], "-checkpoint-every") == 0)
+                rs.checkpointInterval = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "-checkpoint-file") == 0)
+                rs.checkpointFile = argv[i + 1];
+            else if (strcmp(argv[i], "-restart") == 0)
+                rs.restartFile = argv[i + 1];
+            else if (strcmp(argv[i], "-autotune-cache") == 0)
+                rs.autotuneCache = argv[i + 1];
+            else if (strcmp(argv[i], "-verlet-skin") == 0)
+                rs.verletSkin = (float)atof(argv[i + 1]);
+            else if (strcmp(argv[i], "-seed") == 0)
+                rs.seed = strtoull(argv[i + 1], nullptr, 10);
+            else if (strcmp(argv[i], "-scene") == 0)
+            {
+                if (strcmp(argv[i + 1], "corner") == 0)
+                    rs.scene = SceneType::Corner;
+                else if (strcmp(argv[i + 1], "repeat") == 0)
+                    rs.scene = SceneType::Repeat;
+                else if (strcmp(argv[i + 1], "plummer") == 0)
+                    rs.scene = SceneType::Plummer;
+                else if (strcmp(argv[i + 1], "clusters") == 0)
+                    rs.scene = SceneType::Clusters;
+                else
+                    rs.scene = SceneType::Random;
+            }
+            else if (strcmp(argv[i], "-trace") == 0)
+                rs.traceFile = argv[i + 1];
+            else if (strcmp(argv[i], "-counters") == 0)
+            {
+                if (strcmp(argv[i + 1], "json") == 0)
+                    rs.counterFormat = CounterFormat::JSON;
+                else if (strcmp(argv[i + 1], "csv") == 0)
+                    rs.counterFormat = CounterFormat::CSV;
+                else
+                    rs.counterFormat = CounterFormat::None;
+            }
+            else if (strcmp(argv[i], "-tree") == 0)
+            {
+                if (strcmp(argv[i + 1], "morton") == 0)
+                    rs.treeBuilder = TreeBuilderType::Morton;
+                else
+                    rs.treeBuilder = TreeBuilderType::Recursive;
+            }
         }
         if (strcmp(argv[i], "-mpi") == 0)
         {
@@ -59,10 +170,47 @@ StartupOptions parseOptions(int argc, char *argv[])
         {
             rs.simulatorType = SimulatorType::MPILB;
         }
+        else if (strcmp(argv[i], "-deterministic") == 0)
+        {
+            rs.deterministic = true;
+        }
+        else if (strcmp(argv[i], "-self-check") == 0)
+        {
+            rs.selfCheck = true;
+        }
+        else if (strcmp(argv[i], "-pair-forces") == 0)
+        {
+            rs.pairForces = true;
+        }
+        else if (strcmp(argv[i], "-autotune") == 0)
+        {
+            rs.autotune = true;
+        }
+        else if (strcmp(argv[i], "-leaf-batch") == 0)
+        {
+            rs.leafBatch = true;
+        }
     }
     return rs;
 }
 
+void ParticleSoA::resize(size_t n)
+{
+  id.resize(n);
+  mass.resize(n);
+  positionX.resize(n);
+  positionY.resize(n);
+  velocityX.resize(n);
+  velocityY.resize(n);
+}
+
+void ParticleSoA::assign(const std::vector<Particle>& particles)
+{
+  resize(particles.size());
+  for (size_t i = 0; i < particles.size(); i++)
+    set(i, particles[i]);
+}
+
 void Image::setSize(int w, int h)
 {
   width = w;
@@ -116,7 +264,7 @@ void Image::fillRectangle(int x, int y, int size)
 void Image::saveToFile(std::string fileName)
 {
   int filesize = 54 + 3 * width * height;
-  std::vector<unsigned char> img;
+  std::vector<unsigned char>& img = fileData;
   img.resize(3 * width * height);
   for (int j = 0; j < height; j++)
     {
@@ -170,55 +318,32 @@ void Image::saveToFile(std::string fileName)
   file.close();
 }
 
-bool loadFromFile(std::string fileName, std::vector<Particle>& particles)
+bool loadFromFile(std::string fileName, std::vector<Particle>& particles,
+                  ThreadPool* pool)
 {
-  std::ifstream inFile;
-  inFile.open(fileName);
-  if (!inFile)
-    return false;
-
-  std::string line;
-  while (std::getline(inFile, line)) {
-    Particle particle;
-    std::stringstream sstream(line);
-    std::string str;
-    std::getline(sstream, str, ' ');
-    particle.mass = (float)atof(str.c_str());
-    std::getline(sstream, str, ' ');
-    particle.position.x = (float)atof(str.c_str());
-    std::getline(sstream, str, ' ');
-    particle.position.y = (float)atof(str.c_str());
-    std::getline(sstream, str, ' ');
-    particle.velocity.x = (float)atof(str.c_str());
-    std::getline(sstream, str, '\n');
-    particle.velocity.y = (float)atof(str.c_str());
-    particle.id = (int)particles.size();
-    particles.push_back(particle);
-  }
-  inFile.close();
-  return true;
+  if (isSnapshotFile(fileName))
+    return loadSnapshot(fileName, particles);
+  return loadText(fileName, particles, pool);
 }
 
-void saveToFile(std::string fileName, const std::vector<Particle>& particles) {
-  std::ofstream file(fileName);
-  if (!file) {
-    std::cerr << "error writing file \"" << fileName << "\"" << std::endl;
-    return;
-  }
-  file << std::setprecision(9);
-  for (const auto& p : particles) {
-    file << p.mass << " " << p.position.x << " " << p.position.y << " "
-         << p.velocity.x << " " << p.velocity.y << std::endl;
-  }
-  file.close();
-  if (!file)
-    std::cerr << "error writing file \"" << fileName << "\"" << std::endl;
+bool saveToFile(std::string fileName, const std::vector<Particle>& particles,
+                ThreadPool* pool) {
+  if (hasSnapshotSuffix(fileName))
+    return saveSnapshot(fileName, particles);
+  return saveText(fileName, particles, pool);
 }
 
 void dumpView(std::string fileName, float viewportRadius,
               const std::vector<Particle>& particles)
 {
     Image image;
+    QuadTree tree;
+    dumpView(fileName, viewportRadius, particles, image, tree);
+}
+
+void dumpView(std::string fileName, float viewportRadius,
+              const std::vector<Particle>& particles, Image& image, QuadTree& tree)
+{
     const int imageSize = 512;
     image.setSize(imageSize, imageSize);
     image.clear();
@@ -231,7 +356,6 @@ void dumpView(std::string fileName, float viewportRadius,
     }
 
     // overlay visualization on to particle views
-    QuadTree tree;
     buildQuadTree(particles, tree);
     tree.showStructure(image, viewportRadius);
     image.saveToFile(fileName);
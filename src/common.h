@@ -16,18 +16,108 @@ enum class SimulatorType
     MPI, MPILB
 };
 
+enum class TreeBuilderType
+{
+    Recursive, Morton
+};
+
+enum class ForceKernelType
+{
+    Auto, Scalar, AVX2, AVX512
+};
+
+enum class SpatialIndexType
+{
+    QuadTree, UniformGrid
+};
+
+// scenes of the generator used without -in, see scene-generator.h
+enum class SceneType
+{
+    Random, Corner, Repeat, Plummer, Clusters
+};
+
+enum class CounterFormat
+{
+    None, CSV, JSON
+};
+
 struct StartupOptions
 {
     int numIterations = 1;
     int numParticles = 5;
+    // threads per process, including the main thread
+    int numThreads = 1;
     float viewportRadius = 10.0f;
     float spaceSize = 10.0f;
+    // replace the benchmark step parameters of spaceSize if > 0
+    float cullRadius = 0.0f;
+    float deltaTime = 0.0f;
     FrameOutputStyle frameOutputStyle = FrameOutputStyle::FinalFrameOnly;
     std::string outputFile = "out.txt";
     std::string bitmapOutputDir;
     std::string inputFile;
+    // without an input file, -n particles of this scene in -s are generated
+    SceneType scene = SceneType::Random;
+    unsigned long long seed = 1;
     SimulatorType simulatorType = SimulatorType::MPI;
+    TreeBuilderType treeBuilder = TreeBuilderType::Recursive;
+    // update the quadtree in place between iterations; the root bounds get
+    // treeSlack times the extent of margin and are only reset, with a full
+    // build, once particles leave them. Steps where over a quarter of the
+    // particles change leaf also build in full, which is every step of the
+    // benchmark scenes at their time step of 0.2, so the update only pays
+    // off for small steps (it does at -dt 0.001). The slack bounds change
+    // the tree cells and so the summation order: results differ from the
+    // default in rounding.
+    bool incrementalTree = false;
+    float treeSlack = 0.1f;
+    // particles per quadtree leaf and query fan-out, see QuadTree; with
+    // autotune both are timed on the first particles instead, and the
+    // choice is cached in autotuneCache, see autotune.h
+    int leafSize = 8;
+    int fanOut = 4;
+    bool autotune = false;
+    std::string autotuneCache = "autotune-cache.txt";
+    // with a skin > 0, forces use Verlet neighbor lists of radius
+    // cullRadius + verletSkin, rebuilt once a particle moved skin / 2
+    float verletSkin = 0.0f;
+    ForceKernelType forceKernel = ForceKernelType::Auto;
+    SpatialIndexType spatialIndex = SpatialIndexType::QuadTree;
+    // uniform grid cells per cull radius
+    int gridCellsPerRadius = 1;
+    // MPILB repartitions every loadBalanceInterval steps (0: never) and
+    // whenever max rank load / mean rank load exceeds loadBalanceThreshold
+    int loadBalanceInterval = 0;
+    float loadBalanceThreshold = 1.1f;
+    // per iteration record of the hot path counters, see counters.h
+    CounterFormat counterFormat = CounterFormat::None;
+    // Chrome trace of the phases of every thread and rank, if not empty
+    std::string traceFile = "";
     bool checkCorrectness = false;
+    // sums forces in attractor id order, see simulateStepById
+    bool deterministic = false;
+    // reruns the simulation serially on rank 0 and compares the results
+    bool selfCheck = false;
+    // evaluates each pair of particles once, see pair-forces.h
+    bool pairForces = false;
+    // one tree walk per leaf instead of per particle, see leaf-batch.h
+    bool leafBatch = false;
+    // sorts the owned particles along a Hilbert curve every reorderInterval
+    // steps (0: never), and whenever the mean distance between particles
+    // adjacent in memory grew reorderThreshold times since the last sort
+    int reorderInterval = 0;
+    float reorderThreshold = 2.0f;
+    // opening angle of the Barnes-Hut approximation, 0 for exact forces,
+    // see barnes-hut.h
+    float theta = 0.0f;
+    // writes the state to checkpointFile every checkpointInterval steps
+    // (0: never) and resumes from restartFile if not empty, see checkpoint.h.
+    // Checkpoints rebuild the Verlet lists, so with verletSkin > 0 a resumed
+    // run matches only a run with the same checkpointInterval.
+    int checkpointInterval = 0;
+    std::string checkpointFile = "checkpoint.ckpt";
+    std::string restartFile = "";
     std::string referenceAnswerDir = "";
 };
 
@@ -40,6 +130,8 @@ struct StepParameters
 };
 
 StepParameters getBenchmarkStepParams(float spaceSize);
+// the benchmark parameters of -s with the -cull and -dt overrides
+StepParameters getStepParams(const StartupOptions& options);
 
 StartupOptions parseOptions(int argc, char *argv[]);
 
@@ -150,6 +242,49 @@ public:
     Vec2 velocity;
 };
 
+// structure-of-arrays storage for particles, used by the batched force
+// kernels so neighbor fields can be loaded straight into vector registers
+class ParticleSoA
+{
+public:
+    std::vector<int> id;
+    std::vector<float> mass;
+    std::vector<float> positionX, positionY;
+    std::vector<float> velocityX, velocityY;
+
+    size_t size() const { return mass.size(); }
+    void resize(size_t n);
+    void clear() { resize(0); }
+    void assign(const std::vector<Particle>& particles);
+    inline void push_back(const Particle& p)
+    {
+        id.push_back(p.id);
+        mass.push_back(p.mass);
+        positionX.push_back(p.position.x);
+        positionY.push_back(p.position.y);
+        velocityX.push_back(p.velocity.x);
+        velocityY.push_back(p.velocity.y);
+    }
+    inline void set(size_t i, const Particle& p)
+    {
+        id[i] = p.id;
+        mass[i] = p.mass;
+        positionX[i] = p.position.x;
+        positionY[i] = p.position.y;
+        velocityX[i] = p.velocity.x;
+        velocityY[i] = p.velocity.y;
+    }
+    inline Particle get(size_t i) const
+    {
+        Particle p;
+        p.id = id[i];
+        p.mass = mass[i];
+        p.position = Vec2(positionX[i], positionY[i]);
+        p.velocity = Vec2(velocityX[i], velocityY[i]);
+        return p;
+    }
+};
+
 class Pixel
 {
 public:
@@ -161,6 +296,8 @@ class Image
 public:
     int width = 0, height = 0;
     std::vector<Pixel> pixels;
+    // BMP pixel rows, kept so repeated saves do not allocate
+    std::vector<unsigned char> fileData;
     void setSize(int w, int h);
     void clear();
     void drawRectangle(Vec2 bmin, Vec2 bmax);
@@ -174,9 +311,26 @@ inline int clamp(int val, int lbound, int ubound)
     return val < lbound ? lbound : val > ubound ? ubound : val;
 }
 
-bool loadFromFile(std::string fileName, std::vector<Particle>& particles);
-void saveToFile(std::string fileName, const std::vector<Particle>& particles);
+// bounds of all particle positions
+void computeBounds(const std::vector<Particle>& particles, Vec2& bmin, Vec2& bmax);
+
+class ThreadPool;
+class QuadTree;
+
+// Both handle the text format (see text-format.h) and binary snapshots
+// (see snapshot.h). Snapshots are detected by their magic on load and by
+// the ".snap" suffix on save. Text is parsed and formatted on pool's
+// threads when one is given. Both return false, with a message on stderr,
+// if the file cannot be read or written.
+bool loadFromFile(std::string fileName, std::vector<Particle>& particles,
+                  ThreadPool* pool = nullptr);
+bool saveToFile(std::string fileName, const std::vector<Particle>& particles,
+                ThreadPool* pool = nullptr);
 void dumpView(std::string fileName, float viewportRadius, const std::vector<Particle>& particles);
+// Same, drawing into image and building the overlay in tree, so callers
+// that keep them reuse their buffers.
+void dumpView(std::string fileName, float viewportRadius,
+              const std::vector<Particle>& particles, Image& image, QuadTree& tree);
 
 inline Particle updateParticle(const Particle& pi, Vec2 force, float deltaTime)
 {
@@ -0,0 +1,79 @@
+#include "counters.h"
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+// counters of every thread that counted; they live until the process ends
+static std::mutex registryMutex;
+static std::vector<HotPathCounters*> registry;
+
+#ifdef NBODY_COUNTERS
+HotPathCounters& threadCounters()
+{
+  static thread_local HotPathCounters* counters = nullptr;
+  if (!counters) {
+    counters = new HotPathCounters();
+    std::lock_guard<std::mutex> guard(registryMutex);
+    registry.push_back(counters);
+  }
+  return *counters;
+}
+#endif
+
+void collectCounters(HotPathCounters& total)
+{
+  const size_t numFields = sizeof(HotPathCounters) / sizeof(uint64_t);
+  memset(&total, 0, sizeof(total));
+  uint64_t* sum = (uint64_t*)&total;
+  std::lock_guard<std::mutex> guard(registryMutex);
+  for (HotPathCounters* counters : registry) {
+    uint64_t* fields = (uint64_t*)counters;
+    for (size_t f = 0; f < numFields; f++)
+      sum[f] += fields[f];
+    memset(counters, 0, sizeof(*counters));
+  }
+}
+
+static const char* const ScalarNames[] = {
+  "queries", "nodes_visited", "spans", "candidates", "interactions",
+  "rejected_near", "rejected_cull", "leaves"
+};
+
+void printCounters(FILE* file, CounterFormat format, int iteration,
+                   const HotPathCounters& counters)
+{
+  const uint64_t* scalars = &counters.queries;
+  const int numScalars = sizeof(ScalarNames) / sizeof(ScalarNames[0]);
+  if (format == CounterFormat::CSV) {
+    if (iteration == 0) {
+      fprintf(file, "counters,iteration");
+      for (int s = 0; s < numScalars; s++)
+        fprintf(file, ",%s", ScalarNames[s]);
+      for (int b = 0; b < LeafOccupancyBins; b++)
+        fprintf(file, ",leaf_%d%s", b, b == LeafOccupancyBins - 1 ? "_or_more" : "");
+      for (int b = 0; b < CandidateBins; b++)
+        fprintf(file, ",candidates_bin_%d", b);
+      fprintf(file, "\n");
+    }
+    fprintf(file, "counters,%d", iteration);
+    for (int s = 0; s < numScalars; s++)
+      fprintf(file, ",%llu", (unsigned long long)scalars[s]);
+    for (int b = 0; b < LeafOccupancyBins; b++)
+      fprintf(file, ",%llu", (unsigned long long)counters.leafOccupancy[b]);
+    for (int b = 0; b < CandidateBins; b++)
+      fprintf(file, ",%llu", (unsigned long long)counters.candidatesPerQuery[b]);
+    fprintf(file, "\n");
+  } else if (format == CounterFormat::JSON) {
+    fprintf(file, "counters {\"iteration\": %d", iteration);
+    for (int s = 0; s < numScalars; s++)
+      fprintf(file, ", \"%s\": %llu", ScalarNames[s], (unsigned long long)scalars[s]);
+    fprintf(file, ", \"leaf_occupancy\": [");
+    for (int b = 0; b < LeafOccupancyBins; b++)
+      fprintf(file, "%s%llu", b ? ", " : "", (unsigned long long)counters.leafOccupancy[b]);
+    // bin b > 0 counts queries with 2^(b - 1) to 2^b - 1 candidates
+    fprintf(file, "], \"candidates_per_query_log2\": [");
+    for (int b = 0; b < CandidateBins; b++)
+      fprintf(file, "%s%llu", b ? ", " : "", (unsigned long long)counters.candidatesPerQuery[b]);
+    fprintf(file, "]}\n");
+  }
+}
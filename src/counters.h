@@ -0,0 +1,93 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <cstdint>
+#include <cstdio>
+#include "common.h"
+
+// Counts of the work done on the hot paths: tree or grid nodes visited by
+// queries, spans and candidates handed to the force kernel, how many of
+// the candidates interact or are rejected by the 1e-3 and cullRadius tests,
+// and the occupancy of the leaves of every tree built.
+//
+// Every thread counts into its own HotPathCounters, summed once per
+// iteration. The counters are only compiled in with NBODY_COUNTERS
+// (make COUNTERS=1); otherwise COUNT and COUNT_BIN expand to nothing and
+// CountersEnabled is false, so guarded extra work is dropped as well.
+
+// leaves holding 0 .. LeafOccupancyBins - 2 particles, and more
+const int LeafOccupancyBins = 34;
+// queries with 0, 1, 2-3, 4-7, ... candidates
+const int CandidateBins = 24;
+
+struct HotPathCounters
+{
+    uint64_t queries;
+    uint64_t nodesVisited;
+    uint64_t spans;
+    uint64_t candidates;
+    uint64_t interactions;
+    uint64_t rejectedNear;
+    uint64_t rejectedCull;
+    uint64_t leaves;
+    uint64_t leafOccupancy[LeafOccupancyBins];
+    uint64_t candidatesPerQuery[CandidateBins];
+};
+
+#ifdef NBODY_COUNTERS
+const bool CountersEnabled = true;
+HotPathCounters& threadCounters();
+#define COUNT(field, value) (threadCounters().field += (value))
+#define COUNT_BIN(field, bin) (threadCounters().field[bin]++)
+#else
+const bool CountersEnabled = false;
+#define COUNT(field, value) ((void)0)
+#define COUNT_BIN(field, bin) ((void)0)
+#endif
+
+inline int leafOccupancyBin(uint32_t particles)
+{
+    return particles < LeafOccupancyBins - 1 ? (int)particles : LeafOccupancyBins - 1;
+}
+
+inline int candidateBin(uint32_t candidates)
+{
+    int bin = 0;
+    while (candidates > 0 && bin < CandidateBins - 1) {
+        candidates >>= 1;
+        bin++;
+    }
+    return bin;
+}
+
+// Counts the candidates the force kernel rejects at distance below 1e-3
+// (the target itself) or at cullRadius and beyond, and the ones it uses.
+inline void countInteractions(const Particle& target, const float* positionX,
+                              const float* positionY, uint32_t count,
+                              float cullRadius)
+{
+    uint64_t near = 0, culled = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        Vec2 dir = Vec2(positionX[i], positionY[i]) - target.position;
+        float dist = dir.length();
+        if (dist < 1e-3f)
+            near++;
+        else if (dist >= cullRadius)
+            culled++;
+    }
+    COUNT(rejectedNear, near);
+    COUNT(rejectedCull, culled);
+    COUNT(interactions, count - near - culled);
+}
+
+// Sums the counters of all threads into total and clears them. No thread
+// may be counting meanwhile.
+void collectCounters(HotPathCounters& total);
+
+// Prints one record of the counters for an iteration, as a "counters,"
+// prefixed CSV line (after a header line for iteration 0) or as a
+// "counters " prefixed JSON object.
+void printCounters(FILE* file, CounterFormat format, int iteration,
+                   const HotPathCounters& counters);
+
+#endif
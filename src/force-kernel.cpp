@@ -0,0 +1,432 @@
+#include "force-kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FORCE_KERNEL_X86 1
+#endif
+
+// NOTE: the kernels must not be compiled with -ffast-math or FMA
+// contraction, both change the rounding of computeForce. The Makefile
+// passes -ffp-contract=off, which GCC does not default to for C++ even
+// though the AVX-512 target enables FMA instructions.
+
+typedef void (*AccumulateForceFn)(const Particle&, const float*, const float*,
+                                  const float*, uint32_t, float, Vec2&);
+typedef void (*AccumulatePairForcesFn)(const Particle&, const float*, const float*,
+                                       const float*, uint32_t, float, Vec2&,
+                                       float*, float*);
+typedef void (*AccumulateForceBlockFn)(const float*, const float*, const float*,
+                                       uint32_t, const float*, const float*,
+                                       const float*, uint32_t, float, float*,
+                                       float*);
+
+static void accumulateForceScalar(const Particle& target,
+                                  const float* positionX, const float* positionY,
+                                  const float* mass, uint32_t count,
+                                  float cullRadius, Vec2& force)
+{
+  Particle attractor;
+  for (uint32_t i = 0; i < count; i++) {
+    attractor.mass = mass[i];
+    attractor.position = Vec2(positionX[i], positionY[i]);
+    if ((attractor.position - target.position).length() < cullRadius)
+      force += computeForce(target, attractor, cullRadius);
+  }
+}
+
+static void accumulatePairForcesScalar(const Particle& target,
+                                       const float* positionX, const float* positionY,
+                                       const float* mass, uint32_t count,
+                                       float cullRadius, Vec2& force,
+                                       float* reactionX, float* reactionY)
+{
+  Particle attractor;
+  for (uint32_t i = 0; i < count; i++) {
+    attractor.mass = mass[i];
+    attractor.position = Vec2(positionX[i], positionY[i]);
+    if ((attractor.position - target.position).length() < cullRadius) {
+      Vec2 f = computeForce(target, attractor, cullRadius);
+      force += f;
+      reactionX[i] -= f.x;
+      reactionY[i] -= f.y;
+    }
+  }
+}
+
+static void accumulateForceBlockScalar(const float* targetX, const float* targetY,
+                                       const float* targetMass, uint32_t numTargets,
+                                       const float* positionX, const float* positionY,
+                                       const float* mass, uint32_t count,
+                                       float cullRadius, float* forceX, float* forceY)
+{
+  Particle target;
+  for (uint32_t t = 0; t < numTargets; t++) {
+    target.mass = targetMass[t];
+    target.position = Vec2(targetX[t], targetY[t]);
+    Vec2 force = Vec2(forceX[t], forceY[t]);
+    accumulateForceScalar(target, positionX, positionY, mass, count, cullRadius,
+                          force);
+    forceX[t] = force.x;
+    forceY[t] = force.y;
+  }
+}
+
+#ifdef FORCE_KERNEL_X86
+
+__attribute__((target("avx2")))
+static void accumulateForceAVX2(const Particle& target,
+                                const float* positionX, const float* positionY,
+                                const float* mass, uint32_t count,
+                                float cullRadius, Vec2& force)
+{
+  const __m256 targetX = _mm256_set1_ps(target.position.x);
+  const __m256 targetY = _mm256_set1_ps(target.position.y);
+  const __m256 targetMass = _mm256_set1_ps(target.mass);
+  const __m256 cull = _mm256_set1_ps(cullRadius);
+  const __m256 decayBegin = _mm256_set1_ps(cullRadius * 0.75f);
+  const __m256 decayWidth = _mm256_set1_ps(cullRadius * 0.25f);
+  const __m256 minDist = _mm256_set1_ps(1e-3f);
+  const __m256 clampDist = _mm256_set1_ps(1e-1f);
+  const __m256 G = _mm256_set1_ps(0.01f);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  alignas(32) float forceX[8], forceY[8];
+  for (uint32_t i = 0; i < count; i += 8) {
+    uint32_t lanes = count - i < 8 ? count - i : 8;
+    __m256 x, y, m;
+    if (lanes == 8) {
+      x = _mm256_loadu_ps(positionX + i);
+      y = _mm256_loadu_ps(positionY + i);
+      m = _mm256_loadu_ps(mass + i);
+    } else {
+      __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)lanes), laneIndex);
+      x = _mm256_maskload_ps(positionX + i, mask);
+      y = _mm256_maskload_ps(positionY + i, mask);
+      m = _mm256_maskload_ps(mass + i, mask);
+    }
+
+    __m256 dirX = _mm256_sub_ps(x, targetX);
+    __m256 dirY = _mm256_sub_ps(y, targetY);
+    __m256 dist = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dirX, dirX),
+                                               _mm256_mul_ps(dirY, dirY)));
+    // keep = !(dist < 1e-3) && dist < cullRadius
+    __m256 keep = _mm256_and_ps(_mm256_cmp_ps(dist, minDist, _CMP_NLT_UQ),
+                                _mm256_cmp_ps(dist, cull, _CMP_LT_OQ));
+    __m256 invDist = _mm256_div_ps(one, dist);
+    dirX = _mm256_mul_ps(dirX, invDist);
+    dirY = _mm256_mul_ps(dirY, invDist);
+    dist = _mm256_blendv_ps(dist, clampDist, _mm256_cmp_ps(dist, clampDist, _CMP_LT_OQ));
+
+    __m256 scale = _mm256_div_ps(G, _mm256_mul_ps(dist, dist));
+    __m256 fx = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(dirX, targetMass), m), scale);
+    __m256 fy = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(dirY, targetMass), m), scale);
+
+    __m256 decay = _mm256_sub_ps(one, _mm256_div_ps(_mm256_sub_ps(dist, decayBegin),
+                                                    decayWidth));
+    __m256 decays = _mm256_cmp_ps(dist, decayBegin, _CMP_GT_OQ);
+    fx = _mm256_blendv_ps(fx, _mm256_mul_ps(fx, decay), decays);
+    fy = _mm256_blendv_ps(fy, _mm256_mul_ps(fy, decay), decays);
+
+    _mm256_store_ps(forceX, _mm256_and_ps(fx, keep));
+    _mm256_store_ps(forceY, _mm256_and_ps(fy, keep));
+    // culled lanes hold +0.0f, which leaves the sum unchanged
+    for (uint32_t j = 0; j < lanes; j++) {
+      force.x += forceX[j];
+      force.y += forceY[j];
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+static void accumulateForceAVX512(const Particle& target,
+                                  const float* positionX, const float* positionY,
+                                  const float* mass, uint32_t count,
+                                  float cullRadius, Vec2& force)
+{
+  const __m512 targetX = _mm512_set1_ps(target.position.x);
+  const __m512 targetY = _mm512_set1_ps(target.position.y);
+  const __m512 targetMass = _mm512_set1_ps(target.mass);
+  const __m512 cull = _mm512_set1_ps(cullRadius);
+  const __m512 decayBegin = _mm512_set1_ps(cullRadius * 0.75f);
+  const __m512 decayWidth = _mm512_set1_ps(cullRadius * 0.25f);
+  const __m512 minDist = _mm512_set1_ps(1e-3f);
+  const __m512 clampDist = _mm512_set1_ps(1e-1f);
+  const __m512 G = _mm512_set1_ps(0.01f);
+  const __m512 one = _mm512_set1_ps(1.0f);
+
+  alignas(64) float forceX[16], forceY[16];
+  for (uint32_t i = 0; i < count; i += 16) {
+    uint32_t lanes = count - i < 16 ? count - i : 16;
+    __mmask16 load = (__mmask16)((1u << lanes) - 1);
+    __m512 x = _mm512_maskz_loadu_ps(load, positionX + i);
+    __m512 y = _mm512_maskz_loadu_ps(load, positionY + i);
+    __m512 m = _mm512_maskz_loadu_ps(load, mass + i);
+
+    __m512 dirX = _mm512_sub_ps(x, targetX);
+    __m512 dirY = _mm512_sub_ps(y, targetY);
+    __m512 dist = _mm512_sqrt_ps(_mm512_add_ps(_mm512_mul_ps(dirX, dirX),
+                                               _mm512_mul_ps(dirY, dirY)));
+    __mmask16 keep = _mm512_cmp_ps_mask(dist, minDist, _CMP_NLT_UQ) &
+                     _mm512_cmp_ps_mask(dist, cull, _CMP_LT_OQ);
+    __m512 invDist = _mm512_div_ps(one, dist);
+    dirX = _mm512_mul_ps(dirX, invDist);
+    dirY = _mm512_mul_ps(dirY, invDist);
+    dist = _mm512_mask_blend_ps(_mm512_cmp_ps_mask(dist, clampDist, _CMP_LT_OQ),
+                                dist, clampDist);
+
+    __m512 scale = _mm512_div_ps(G, _mm512_mul_ps(dist, dist));
+    __m512 fx = _mm512_mul_ps(_mm512_mul_ps(_mm512_mul_ps(dirX, targetMass), m), scale);
+    __m512 fy = _mm512_mul_ps(_mm512_mul_ps(_mm512_mul_ps(dirY, targetMass), m), scale);
+
+    __m512 decay = _mm512_sub_ps(one, _mm512_div_ps(_mm512_sub_ps(dist, decayBegin),
+                                                    decayWidth));
+    __mmask16 decays = _mm512_cmp_ps_mask(dist, decayBegin, _CMP_GT_OQ);
+    fx = _mm512_mask_mul_ps(fx, decays, fx, decay);
+    fy = _mm512_mask_mul_ps(fy, decays, fy, decay);
+
+    _mm512_store_ps(forceX, _mm512_maskz_mov_ps(keep, fx));
+    _mm512_store_ps(forceY, _mm512_maskz_mov_ps(keep, fy));
+    for (uint32_t j = 0; j < lanes; j++) {
+      force.x += forceX[j];
+      force.y += forceY[j];
+    }
+  }
+}
+
+// accumulateForceAVX2 that also subtracts every force from the reaction
+// arrays; the AVX-512 kernel selection uses it as well
+__attribute__((target("avx2")))
+static void accumulatePairForcesAVX2(const Particle& target,
+                                     const float* positionX, const float* positionY,
+                                     const float* mass, uint32_t count,
+                                     float cullRadius, Vec2& force,
+                                     float* reactionX, float* reactionY)
+{
+  const __m256 targetX = _mm256_set1_ps(target.position.x);
+  const __m256 targetY = _mm256_set1_ps(target.position.y);
+  const __m256 targetMass = _mm256_set1_ps(target.mass);
+  const __m256 cull = _mm256_set1_ps(cullRadius);
+  const __m256 decayBegin = _mm256_set1_ps(cullRadius * 0.75f);
+  const __m256 decayWidth = _mm256_set1_ps(cullRadius * 0.25f);
+  const __m256 minDist = _mm256_set1_ps(1e-3f);
+  const __m256 clampDist = _mm256_set1_ps(1e-1f);
+  const __m256 G = _mm256_set1_ps(0.01f);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  alignas(32) float forceX[8], forceY[8];
+  for (uint32_t i = 0; i < count; i += 8) {
+    uint32_t lanes = count - i < 8 ? count - i : 8;
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)lanes), laneIndex);
+    __m256 x = _mm256_maskload_ps(positionX + i, mask);
+    __m256 y = _mm256_maskload_ps(positionY + i, mask);
+    __m256 m = _mm256_maskload_ps(mass + i, mask);
+
+    __m256 dirX = _mm256_sub_ps(x, targetX);
+    __m256 dirY = _mm256_sub_ps(y, targetY);
+    __m256 dist = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dirX, dirX),
+                                               _mm256_mul_ps(dirY, dirY)));
+    __m256 keep = _mm256_and_ps(_mm256_cmp_ps(dist, minDist, _CMP_NLT_UQ),
+                                _mm256_cmp_ps(dist, cull, _CMP_LT_OQ));
+    __m256 invDist = _mm256_div_ps(one, dist);
+    dirX = _mm256_mul_ps(dirX, invDist);
+    dirY = _mm256_mul_ps(dirY, invDist);
+    dist = _mm256_blendv_ps(dist, clampDist, _mm256_cmp_ps(dist, clampDist, _CMP_LT_OQ));
+
+    __m256 scale = _mm256_div_ps(G, _mm256_mul_ps(dist, dist));
+    __m256 fx = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(dirX, targetMass), m), scale);
+    __m256 fy = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(dirY, targetMass), m), scale);
+
+    __m256 decay = _mm256_sub_ps(one, _mm256_div_ps(_mm256_sub_ps(dist, decayBegin),
+                                                    decayWidth));
+    __m256 decays = _mm256_cmp_ps(dist, decayBegin, _CMP_GT_OQ);
+    fx = _mm256_and_ps(_mm256_blendv_ps(fx, _mm256_mul_ps(fx, decay), decays), keep);
+    fy = _mm256_and_ps(_mm256_blendv_ps(fy, _mm256_mul_ps(fy, decay), decays), keep);
+
+    _mm256_maskstore_ps(reactionX + i, mask,
+                        _mm256_sub_ps(_mm256_maskload_ps(reactionX + i, mask), fx));
+    _mm256_maskstore_ps(reactionY + i, mask,
+                        _mm256_sub_ps(_mm256_maskload_ps(reactionY + i, mask), fy));
+    _mm256_store_ps(forceX, fx);
+    _mm256_store_ps(forceY, fy);
+    for (uint32_t j = 0; j < lanes; j++) {
+      force.x += forceX[j];
+      force.y += forceY[j];
+    }
+  }
+}
+
+// accumulateForceAVX2 transposed: eight targets in the lanes, one
+// attractor broadcast per iteration; the AVX-512 kernel selection uses it
+// as well
+__attribute__((target("avx2")))
+static void accumulateForceBlockAVX2(const float* targetX, const float* targetY,
+                                     const float* targetMass, uint32_t numTargets,
+                                     const float* positionX, const float* positionY,
+                                     const float* mass, uint32_t count,
+                                     float cullRadius, float* forceX, float* forceY)
+{
+  const __m256 cull = _mm256_set1_ps(cullRadius);
+  const __m256 decayBegin = _mm256_set1_ps(cullRadius * 0.75f);
+  const __m256 decayWidth = _mm256_set1_ps(cullRadius * 0.25f);
+  const __m256 minDist = _mm256_set1_ps(1e-3f);
+  const __m256 clampDist = _mm256_set1_ps(1e-1f);
+  const __m256 G = _mm256_set1_ps(0.01f);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  for (uint32_t t = 0; t < numTargets; t += 8) {
+    uint32_t lanes = numTargets - t < 8 ? numTargets - t : 8;
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)lanes), laneIndex);
+    __m256 tx = _mm256_maskload_ps(targetX + t, mask);
+    __m256 ty = _mm256_maskload_ps(targetY + t, mask);
+    __m256 tm = _mm256_maskload_ps(targetMass + t, mask);
+    __m256 sumX = _mm256_maskload_ps(forceX + t, mask);
+    __m256 sumY = _mm256_maskload_ps(forceY + t, mask);
+    for (uint32_t i = 0; i < count; i++) {
+      __m256 dirX = _mm256_sub_ps(_mm256_set1_ps(positionX[i]), tx);
+      __m256 dirY = _mm256_sub_ps(_mm256_set1_ps(positionY[i]), ty);
+      __m256 dist = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dirX, dirX),
+                                                 _mm256_mul_ps(dirY, dirY)));
+      __m256 keep = _mm256_and_ps(_mm256_cmp_ps(dist, minDist, _CMP_NLT_UQ),
+                                  _mm256_cmp_ps(dist, cull, _CMP_LT_OQ));
+      __m256 invDist = _mm256_div_ps(one, dist);
+      dirX = _mm256_mul_ps(dirX, invDist);
+      dirY = _mm256_mul_ps(dirY, invDist);
+      dist = _mm256_blendv_ps(dist, clampDist, _mm256_cmp_ps(dist, clampDist, _CMP_LT_OQ));
+
+      __m256 m = _mm256_set1_ps(mass[i]);
+      __m256 scale = _mm256_div_ps(G, _mm256_mul_ps(dist, dist));
+      __m256 fx = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(dirX, tm), m), scale);
+      __m256 fy = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(dirY, tm), m), scale);
+
+      __m256 decay = _mm256_sub_ps(one, _mm256_div_ps(_mm256_sub_ps(dist, decayBegin),
+                                                      decayWidth));
+      __m256 decays = _mm256_cmp_ps(dist, decayBegin, _CMP_GT_OQ);
+      fx = _mm256_blendv_ps(fx, _mm256_mul_ps(fx, decay), decays);
+      fy = _mm256_blendv_ps(fy, _mm256_mul_ps(fy, decay), decays);
+      // culled lanes add +0.0f, which leaves their sums unchanged
+      sumX = _mm256_add_ps(sumX, _mm256_and_ps(fx, keep));
+      sumY = _mm256_add_ps(sumY, _mm256_and_ps(fy, keep));
+    }
+    _mm256_maskstore_ps(forceX + t, mask, sumX);
+    _mm256_maskstore_ps(forceY + t, mask, sumY);
+  }
+}
+
+#endif
+
+static AccumulateForceBlockFn blockKernelFn(ForceKernelType type)
+{
+  switch (type) {
+#ifdef FORCE_KERNEL_X86
+  case ForceKernelType::AVX2:
+  case ForceKernelType::AVX512:
+    return accumulateForceBlockAVX2;
+#endif
+  default:
+    return accumulateForceBlockScalar;
+  }
+}
+
+static AccumulatePairForcesFn pairKernelFn(ForceKernelType type)
+{
+  switch (type) {
+#ifdef FORCE_KERNEL_X86
+  case ForceKernelType::AVX2:
+  case ForceKernelType::AVX512:
+    return accumulatePairForcesAVX2;
+#endif
+  default:
+    return accumulatePairForcesScalar;
+  }
+}
+
+static AccumulateForceFn forceKernelFn(ForceKernelType type)
+{
+  switch (type) {
+#ifdef FORCE_KERNEL_X86
+  case ForceKernelType::AVX2:
+    return accumulateForceAVX2;
+  case ForceKernelType::AVX512:
+    return accumulateForceAVX512;
+#endif
+  default:
+    return accumulateForceScalar;
+  }
+}
+
+static ForceKernelType supportedForceKernel(ForceKernelType type)
+{
+#ifdef FORCE_KERNEL_X86
+  __builtin_cpu_init();
+  bool avx512 = __builtin_cpu_supports("avx512f");
+  bool avx2 = __builtin_cpu_supports("avx2");
+  if (type == ForceKernelType::Scalar)
+    return type;
+  if ((type == ForceKernelType::Auto || type == ForceKernelType::AVX512) && avx512)
+    return ForceKernelType::AVX512;
+  if (avx2)
+    return ForceKernelType::AVX2;
+#endif
+  return ForceKernelType::Scalar;
+}
+
+static AccumulateForceFn accumulateForceImpl =
+    forceKernelFn(supportedForceKernel(ForceKernelType::Auto));
+static AccumulatePairForcesFn accumulatePairForcesImpl =
+    pairKernelFn(supportedForceKernel(ForceKernelType::Auto));
+static AccumulateForceBlockFn accumulateForceBlockImpl =
+    blockKernelFn(supportedForceKernel(ForceKernelType::Auto));
+
+ForceKernelType setForceKernel(ForceKernelType type)
+{
+  ForceKernelType selected = supportedForceKernel(type);
+  accumulateForceImpl = forceKernelFn(selected);
+  accumulatePairForcesImpl = pairKernelFn(selected);
+  accumulateForceBlockImpl = blockKernelFn(selected);
+  return selected;
+}
+
+const char* forceKernelName(ForceKernelType type)
+{
+  switch (type) {
+  case ForceKernelType::Scalar:
+    return "scalar";
+  case ForceKernelType::AVX2:
+    return "avx2";
+  case ForceKernelType::AVX512:
+    return "avx512";
+  default:
+    return "auto";
+  }
+}
+
+void accumulateForce(const Particle& target,
+                     const float* positionX, const float* positionY,
+                     const float* mass, uint32_t count,
+                     float cullRadius, Vec2& force)
+{
+  accumulateForceImpl(target, positionX, positionY, mass, count, cullRadius, force);
+}
+
+void accumulatePairForces(const Particle& target,
+                          const float* positionX, const float* positionY,
+                          const float* mass, uint32_t count,
+                          float cullRadius, Vec2& force,
+                          float* reactionX, float* reactionY)
+{
+  accumulatePairForcesImpl(target, positionX, positionY, mass, count, cullRadius,
+                           force, reactionX, reactionY);
+}
+
+void accumulateForceBlock(const float* targetX, const float* targetY,
+                          const float* targetMass, uint32_t numTargets,
+                          const float* positionX, const float* positionY,
+                          const float* mass, uint32_t count,
+                          float cullRadius, float* forceX, float* forceY)
+{
+  accumulateForceBlockImpl(targetX, targetY, targetMass, numTargets, positionX,
+                           positionY, mass, count, cullRadius, forceX, forceY);
+}
@@ -0,0 +1,57 @@
+#ifndef FORCE_KERNEL_H
+#define FORCE_KERNEL_H
+
+#include <cstdint>
+#include "common.h"
+
+// Adds computeForce(target, attractor, cullRadius) to force for every
+// attractor (positionX[i], positionY[i], mass[i]) with i < count, in order.
+// The vector kernels evaluate 8 (AVX2) or 16 (AVX-512) attractors per
+// instruction with the same IEEE operations as computeForce and add the
+// lanes up sequentially, so the result is bit identical to the scalar loop.
+//
+// Attractors at distance cullRadius or more are skipped, the same strict
+// test QuadTree::getParticles applies. That makes accumulating over whole
+// leaf ranges identical to accumulating over the filtered query result.
+// The target itself may be among the attractors: at distance zero it is
+// skipped by the 1e-3 test like in computeForce.
+void accumulateForce(const Particle& target,
+                     const float* positionX, const float* positionY,
+                     const float* mass, uint32_t count,
+                     float cullRadius, Vec2& force);
+
+// Same, and subtracts each attractor's force from reactionX[i] and
+// reactionY[i], which applies the equal and opposite force to it. Used by
+// PairForces; every force is bit identical to the one accumulateForce adds.
+void accumulatePairForces(const Particle& target,
+                          const float* positionX, const float* positionY,
+                          const float* mass, uint32_t count,
+                          float cullRadius, Vec2& force,
+                          float* reactionX, float* reactionY);
+
+// Adds the forces of the same attractors on each of numTargets targets
+// (targetX[t], targetY[t], targetMass[t]) to forceX[t] and forceY[t]. The
+// vector kernels put one target in each lane and walk the attractors in
+// order, so every target's sum is bit identical to accumulateForce's.
+void accumulateForceBlock(const float* targetX, const float* targetY,
+                          const float* targetMass, uint32_t numTargets,
+                          const float* positionX, const float* positionY,
+                          const float* mass, uint32_t count,
+                          float cullRadius, float* forceX, float* forceY);
+
+inline void accumulateForce(const Particle& target, const ParticleSoA& attractors,
+                            uint32_t begin, uint32_t end,
+                            float cullRadius, Vec2& force)
+{
+  accumulateForce(target, attractors.positionX.data() + begin,
+                  attractors.positionY.data() + begin,
+                  attractors.mass.data() + begin, end - begin,
+                  cullRadius, force);
+}
+
+// Selects the kernel used by accumulateForce. Auto, and requests the CPU
+// cannot run, pick the widest supported one. Returns the kernel selected.
+ForceKernelType setForceKernel(ForceKernelType type);
+const char* forceKernelName(ForceKernelType type);
+
+#endif
@@ -0,0 +1,81 @@
+#include "frame-writer.h"
+#include "timing.h"
+#include "trace.h"
+
+FrameWriter::FrameWriter(float viewportRadius, int numThreads, int numBuffers)
+  : viewportRadius(viewportRadius), frames(numBuffers < 1 ? 1 : numBuffers)
+{
+  for (int i = 0; i < (int)frames.size(); i++)
+    freeFrames.push_back(i);
+  for (int i = 0; i < (numThreads < 1 ? 1 : numThreads); i++)
+    threads.emplace_back(&FrameWriter::workerLoop, this);
+}
+
+FrameWriter::~FrameWriter()
+{
+  finish();
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    stopping = true;
+  }
+  frameQueued.notify_all();
+  for (auto& thread : threads)
+    thread.join();
+}
+
+double FrameWriter::queueFrame(const std::string& fileName,
+                               const std::vector<Particle>& particles)
+{
+  TraceSpan span("frame queue");
+  std::unique_lock<std::mutex> guard(mutex);
+  double waited = 0.0;
+  if (freeFrames.empty()) {
+    Timer t;
+    frameDone.wait(guard, [&] { return !freeFrames.empty(); });
+    waited = t.elapsed();
+    stalls++;
+    stallTime += waited;
+  }
+  int index = freeFrames.back();
+  freeFrames.pop_back();
+  framesInFlight++;
+  // the buffer is ours until it is queued, copy without holding the lock
+  guard.unlock();
+  Frame& frame = frames[index];
+  frame.fileName = fileName;
+  frame.particles.assign(particles.begin(), particles.end());
+  guard.lock();
+  queuedFrames.push_back(index);
+  framesQueued++;
+  guard.unlock();
+  frameQueued.notify_one();
+  return waited;
+}
+
+void FrameWriter::finish()
+{
+  std::unique_lock<std::mutex> guard(mutex);
+  frameDone.wait(guard, [&] { return framesInFlight == 0; });
+}
+
+void FrameWriter::workerLoop()
+{
+  setTraceThreadName("frame writer");
+  std::unique_lock<std::mutex> guard(mutex);
+  for (;;) {
+    frameQueued.wait(guard, [&] { return stopping || !queuedFrames.empty(); });
+    if (queuedFrames.empty())
+      return;
+    int index = queuedFrames.front();
+    queuedFrames.pop_front();
+    guard.unlock();
+    Frame& frame = frames[index];
+    TraceSpan span("frame dump");
+    dumpView(frame.fileName, viewportRadius, frame.particles, frame.image,
+             frame.tree);
+    guard.lock();
+    freeFrames.push_back(index);
+    framesInFlight--;
+    frameDone.notify_all();
+  }
+}
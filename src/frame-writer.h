@@ -0,0 +1,59 @@
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common.h"
+#include "quad-tree.h"
+
+// Draws and saves frames with dumpView on background threads, so -fo does
+// not hold up the simulation. Each of a fixed number of frame buffers
+// keeps its particle copy, image and overlay tree between frames, so
+// steady state output does not allocate. When every buffer is still being
+// drawn, queueFrame waits for one, and that wait is counted as a stall.
+class FrameWriter
+{
+public:
+    FrameWriter(float viewportRadius, int numThreads, int numBuffers);
+    // waits for the queued frames to be written
+    ~FrameWriter();
+
+    // Copies the particles and queues their frame to be saved as fileName.
+    // Returns the seconds spent waiting for a free buffer.
+    double queueFrame(const std::string& fileName,
+                      const std::vector<Particle>& particles);
+
+    // Blocks until every queued frame has been written.
+    void finish();
+
+    int framesQueued = 0;
+    int stalls = 0;
+    double stallTime = 0.0;
+
+private:
+    struct Frame
+    {
+        std::string fileName;
+        std::vector<Particle> particles;
+        Image image;
+        QuadTree tree;
+    };
+
+    void workerLoop();
+
+    float viewportRadius;
+    std::vector<Frame> frames;
+    std::vector<int> freeFrames;
+    std::deque<int> queuedFrames;
+    int framesInFlight = 0;
+    std::mutex mutex;
+    std::condition_variable frameQueued, frameDone;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
+
+#endif
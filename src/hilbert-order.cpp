@@ -0,0 +1,57 @@
+#include "hilbert-order.h"
+#include <algorithm>
+
+const int HilbertBits = 16;
+
+uint32_t hilbertKey(Vec2 position, Vec2 bmin, Vec2 bmax)
+{
+  const uint32_t side = 1u << HilbertBits;
+  Vec2 extent = bmax - bmin;
+  float fx = extent.x > 0.0f ? (position.x - bmin.x) / extent.x * side : 0.0f;
+  float fy = extent.y > 0.0f ? (position.y - bmin.y) / extent.y * side : 0.0f;
+  uint32_t x = fx <= 0.0f ? 0 : fx >= side - 1 ? side - 1 : (uint32_t)fx;
+  uint32_t y = fy <= 0.0f ? 0 : fy >= side - 1 ? side - 1 : (uint32_t)fy;
+  uint32_t key = 0;
+  for (uint32_t s = side / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) ? 1 : 0;
+    uint32_t ry = (y & s) ? 1 : 0;
+    key += s * s * ((3 * rx) ^ ry);
+    // rotate the quadrant so the curve continues from the previous one
+    if (ry == 0) {
+      if (rx == 1) {
+        x = side - 1 - x;
+        y = side - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return key;
+}
+
+double meanNeighborGap(const std::vector<Particle>& particles)
+{
+  if (particles.size() < 2)
+    return 0.0;
+  double total = 0.0;
+  for (size_t i = 1; i < particles.size(); i++)
+    total += (particles[i].position - particles[i - 1].position).length();
+  return total / (particles.size() - 1);
+}
+
+void sortByHilbert(std::vector<Particle>& particles,
+                   std::vector<Particle>& scratch)
+{
+  if (particles.empty())
+    return;
+  Vec2 bmin, bmax;
+  computeBounds(particles, bmin, bmax);
+  std::vector<std::pair<uint64_t, uint32_t>> keys(particles.size());
+  for (uint32_t i = 0; i < (uint32_t)particles.size(); i++)
+    keys[i] = std::make_pair(((uint64_t)hilbertKey(particles[i].position, bmin, bmax) << 32) |
+                             (uint32_t)particles[i].id, i);
+  std::sort(keys.begin(), keys.end());
+  scratch.resize(particles.size());
+  for (size_t i = 0; i < keys.size(); i++)
+    scratch[i] = particles[keys[i].second];
+  particles.swap(scratch);
+}
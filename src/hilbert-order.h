@@ -0,0 +1,27 @@
+#ifndef HILBERT_ORDER_H
+#define HILBERT_ORDER_H
+
+#include <cstdint>
+#include <vector>
+#include "common.h"
+
+// Spatial ordering of a particle array along a Hilbert curve, so particles
+// close in space are close in memory. The force loop then queries nearby
+// positions one after another and finds the tree nodes and candidates it
+// needs still in cache. The order of the owned particles does not change
+// any result: every rank builds its index from the halo, which is sorted
+// by id, and steps each particle on its own.
+
+// Hilbert curve index of position in [bmin, bmax], 16 bits per axis.
+uint32_t hilbertKey(Vec2 position, Vec2 bmin, Vec2 bmax);
+
+// Mean distance between particles adjacent in the array, which grows as
+// the order stops following space.
+double meanNeighborGap(const std::vector<Particle>& particles);
+
+// Sorts particles by the Hilbert key over their bounds, ties by id. The
+// ids are kept, so gathering by id restores the input order.
+void sortByHilbert(std::vector<Particle>& particles,
+                   std::vector<Particle>& scratch);
+
+#endif
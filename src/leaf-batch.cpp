@@ -0,0 +1,97 @@
+#include "leaf-batch.h"
+#include "counters.h"
+#include "force-kernel.h"
+#include "thread-pool.h"
+#include "trace.h"
+
+// leaves per chunk of the force loop
+const uint32_t LeafBatchChunkSize = 32;
+
+static void collectLeaves(const QuadTree& tree, uint32_t nodeIndex,
+                          std::vector<uint32_t>& leaves)
+{
+  const QuadTreeNode& node = tree.nodes[nodeIndex];
+  if (node.isLeaf) {
+    if (node.particleBegin != node.particleEnd)
+      leaves.push_back(nodeIndex);
+    return;
+  }
+  for (int i = 0; i < 4; i++)
+    collectLeaves(tree, node.firstChild + i, leaves);
+}
+
+void LeafBatchedForces::simulateStep(const QuadTree& tree,
+                                     const std::vector<Particle>& particles,
+                                     std::vector<Particle>& newParticles,
+                                     StepParameters params, size_t numIds,
+                                     ThreadPool* pool, uint32_t* interactions)
+{
+  leaves.clear();
+  if (!tree.nodes.empty())
+    collectLeaves(tree, 0, leaves);
+  indexOfId.resize(numIds, -1);
+  for (uint32_t i = 0; i < (uint32_t)particles.size(); i++)
+    indexOfId[particles[i].id] = (int)i;
+
+  const ParticleSoA& soa = tree.particlesSoA;
+  parallelFor(pool, (uint32_t)leaves.size(), [&](uint32_t begin, uint32_t end) {
+    TraceSpan span("force chunk");
+    // the owned particles of one leaf and their forces
+    static thread_local std::vector<uint32_t> targets;
+    static thread_local std::vector<float> targetX, targetY, targetMass;
+    static thread_local std::vector<float> forceX, forceY;
+    for (uint32_t l = begin; l < end; l++) {
+      const QuadTreeNode& leaf = tree.nodes[leaves[l]];
+      targets.clear();
+      targetX.clear();
+      targetY.clear();
+      targetMass.clear();
+      Vec2 boxMin = Vec2(1e30f, 1e30f), boxMax = Vec2(-1e30f, -1e30f);
+      for (uint32_t k = leaf.particleBegin; k < leaf.particleEnd; k++) {
+        int i = indexOfId[soa.id[k]];
+        if (i < 0 || i >= (int)particles.size() || particles[i].id != soa.id[k])
+          continue;
+        targets.push_back((uint32_t)i);
+        targetX.push_back(soa.positionX[k]);
+        targetY.push_back(soa.positionY[k]);
+        targetMass.push_back(soa.mass[k]);
+        boxMin.x = fminf(boxMin.x, soa.positionX[k]);
+        boxMin.y = fminf(boxMin.y, soa.positionY[k]);
+        boxMax.x = fmaxf(boxMax.x, soa.positionX[k]);
+        boxMax.y = fmaxf(boxMax.y, soa.positionY[k]);
+      }
+      uint32_t numTargets = (uint32_t)targets.size();
+      if (numTargets == 0)
+        continue;
+      forceX.assign(numTargets, 0.0f);
+      forceY.assign(numTargets, 0.0f);
+      uint32_t candidates = 0;
+      tree.forEachSpanNearBox(boxMin, boxMax, params.cullRadius,
+                              [&](uint32_t spanBegin, uint32_t spanEnd) {
+        accumulateForceBlock(targetX.data(), targetY.data(), targetMass.data(),
+                             numTargets, soa.positionX.data() + spanBegin,
+                             soa.positionY.data() + spanBegin,
+                             soa.mass.data() + spanBegin, spanEnd - spanBegin,
+                             params.cullRadius, forceX.data(), forceY.data());
+        candidates += spanEnd - spanBegin;
+        COUNT(spans, 1);
+        if (CountersEnabled)
+          for (uint32_t t = 0; t < numTargets; t++)
+            countInteractions(particles[targets[t]],
+                              soa.positionX.data() + spanBegin,
+                              soa.positionY.data() + spanBegin,
+                              spanEnd - spanBegin, params.cullRadius);
+      });
+      COUNT(queries, 1);
+      COUNT(candidates, (uint64_t)candidates * numTargets);
+      for (uint32_t t = 0; t < numTargets; t++) {
+        uint32_t i = targets[t];
+        COUNT_BIN(candidatesPerQuery, candidateBin(candidates));
+        if (interactions)
+          interactions[i] = candidates;
+        newParticles[i] = updateParticle(particles[i], Vec2(forceX[t], forceY[t]),
+                                         params.deltaTime);
+      }
+    }
+  }, LeafBatchChunkSize);
+}
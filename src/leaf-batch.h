@@ -0,0 +1,40 @@
+#ifndef LEAF_BATCH_H
+#define LEAF_BATCH_H
+
+#include <cstdint>
+#include <vector>
+#include "common.h"
+#include "quad-tree.h"
+
+class ThreadPool;
+
+// Force evaluation by leaf: the particles of a leaf share one tree walk,
+// for the leaf's bounding box grown by cullRadius, and the spans it finds
+// are evaluated for all of them at once by accumulateForceBlock.
+//
+// The spans of the box hold every span a single particle's query would
+// find, in the same tree order, and the kernel culls the extra attractors
+// exactly like the leaves beyond cullRadius. The sums are therefore the
+// same as simulateStep's, bit for bit, with one walk per leaf instead of
+// one per particle.
+class LeafBatchedForces
+{
+public:
+    // Same as simulateStep over tree. Particle ids are below numIds. If
+    // interactions is not null, interactions[i] receives the number of
+    // attractors evaluated for particles[i].
+    void simulateStep(const QuadTree& tree,
+                      const std::vector<Particle>& particles,
+                      std::vector<Particle>& newParticles,
+                      StepParameters params, size_t numIds, ThreadPool* pool,
+                      uint32_t* interactions = nullptr);
+
+private:
+    // the non empty leaves in tree order
+    std::vector<uint32_t> leaves;
+    // index in particles of every id; stale entries are caught by an id
+    // check, tree particles of other ranks have none
+    std::vector<int> indexOfId;
+};
+
+#endif
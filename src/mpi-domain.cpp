@@ -0,0 +1,189 @@
+#include "mpi-domain.h"
+#include <algorithm>
+
+static bool lessById(const Particle& a, const Particle& b)
+{
+  return a.id < b.id;
+}
+
+ParticleExchange::ParticleExchange(MPI_Comm comm) : comm(comm)
+{
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &numRanks);
+  MPI_Type_contiguous((int)sizeof(Particle), MPI_BYTE, &particleType);
+  MPI_Type_commit(&particleType);
+  outgoing.resize(numRanks);
+  sendCounts.resize(numRanks);
+  sendDispls.resize(numRanks);
+  recvCounts.resize(numRanks);
+  recvDispls.resize(numRanks);
+}
+
+ParticleExchange::~ParticleExchange()
+{
+  MPI_Type_free(&particleType);
+}
+
+void ParticleExchange::exchange(std::vector<Particle>& incoming)
+{
+  sendBuffer.clear();
+  for (int r = 0; r < numRanks; r++) {
+    sendDispls[r] = (int)sendBuffer.size();
+    sendCounts[r] = (int)outgoing[r].size();
+    sendBuffer.insert(sendBuffer.end(), outgoing[r].begin(), outgoing[r].end());
+    outgoing[r].clear();
+  }
+
+  MPI_Alltoall(sendCounts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, comm);
+  size_t base = incoming.size();
+  int total = 0;
+  for (int r = 0; r < numRanks; r++) {
+    recvDispls[r] = total;
+    total += recvCounts[r];
+  }
+  incoming.resize(base + total);
+  MPI_Alltoallv(sendBuffer.data(), sendCounts.data(), sendDispls.data(), particleType,
+                incoming.data() + base, recvCounts.data(), recvDispls.data(),
+                particleType, comm);
+}
+
+void SlabDecomposition::partitionEvenly(const std::vector<Particle>& particles,
+                                        int numRanks)
+{
+  std::vector<float> xs(particles.size());
+  for (size_t i = 0; i < particles.size(); i++)
+    xs[i] = particles[i].position.x;
+  std::sort(xs.begin(), xs.end());
+  splits.resize(numRanks - 1);
+  for (int r = 1; r < numRanks; r++)
+    splits[r - 1] = xs.empty() ? 0.0f : xs[xs.size() * r / numRanks];
+}
+
+// resolution of the cost histogram used to place the slab splits
+const int NumCostBins = 4096;
+
+void partitionByCost(SlabDecomposition& domain,
+                     const std::vector<Particle>& owned,
+                     const std::vector<uint32_t>& cost,
+                     ParticleExchange& exchange)
+{
+  if (exchange.numRanks == 1)
+    return;
+  Vec2 bmin, bmax;
+  computeGlobalBounds(owned, bmin, bmax, exchange.comm);
+  float lo = bmin.x;
+  float extent = bmax.x - bmin.x;
+  float scale = extent > 0.0f ? NumCostBins / extent : 0.0f;
+
+  // integer sums are exact, so the reduction is the same on every rank
+  std::vector<unsigned long long> histogram(NumCostBins, 0);
+  for (size_t i = 0; i < owned.size(); i++) {
+    int bin = clamp((int)((owned[i].position.x - lo) * scale), 0, NumCostBins - 1);
+    histogram[bin] += cost[i];
+  }
+  MPI_Allreduce(MPI_IN_PLACE, histogram.data(), NumCostBins,
+                MPI_UNSIGNED_LONG_LONG, MPI_SUM, exchange.comm);
+
+  unsigned long long total = 0;
+  for (auto weight : histogram)
+    total += weight;
+  if (total == 0)
+    return;
+
+  // split r goes where the cumulative cost reaches r / numRanks of the
+  // total, interpolating within the bin
+  int bin = 0;
+  unsigned long long below = 0;
+  for (int r = 1; r < exchange.numRanks; r++) {
+    double target = (double)total * r / exchange.numRanks;
+    while (bin < NumCostBins - 1 && below + histogram[bin] < target)
+      below += histogram[bin++];
+    double fraction = histogram[bin] ? (target - below) / histogram[bin] : 0.0;
+    fraction = std::min(std::max(fraction, 0.0), 1.0);
+    domain.splits[r - 1] = lo + (float)((bin + fraction) * extent / NumCostBins);
+  }
+}
+
+void distributeParticles(const std::vector<Particle>& allParticles,
+                         SlabDecomposition& domain,
+                         std::vector<Particle>& owned,
+                         ParticleExchange& exchange)
+{
+  if (exchange.rank == 0)
+    domain.partitionEvenly(allParticles, exchange.numRanks);
+  domain.splits.resize(exchange.numRanks - 1);
+  MPI_Bcast(domain.splits.data(), (int)domain.splits.size(), MPI_FLOAT, 0,
+            exchange.comm);
+
+  if (exchange.rank == 0)
+    for (auto& p : allParticles)
+      exchange.outgoing[domain.owner(p.position.x)].push_back(p);
+  owned.clear();
+  exchange.exchange(owned);
+}
+
+void migrateParticles(const SlabDecomposition& domain,
+                      std::vector<Particle>& owned,
+                      ParticleExchange& exchange)
+{
+  size_t kept = 0;
+  for (size_t i = 0; i < owned.size(); i++) {
+    int dest = domain.owner(owned[i].position.x);
+    if (dest == exchange.rank)
+      owned[kept++] = owned[i];
+    else
+      exchange.outgoing[dest].push_back(owned[i]);
+  }
+  owned.resize(kept);
+  exchange.exchange(owned);
+  // arrivals are merged by id into owned sorted by id, and appended by id
+  // to owned in any other order, e.g. that of sortByHilbert
+  if (owned.size() != kept) {
+    std::sort(owned.begin() + kept, owned.end(), lessById);
+    if (std::is_sorted(owned.begin(), owned.begin() + kept, lessById))
+      std::inplace_merge(owned.begin(), owned.begin() + kept, owned.end(),
+                         lessById);
+  }
+}
+
+void gatherHalo(const SlabDecomposition& domain,
+                const std::vector<Particle>& owned, float radius,
+                std::vector<Particle>& local,
+                ParticleExchange& exchange)
+{
+  // padded like the grid query so rounding never drops a particle the
+  // distance test would accept
+  float reach = radius * 1.0001f;
+  for (auto& p : owned) {
+    int first = domain.owner(p.position.x - reach);
+    int last = domain.owner(p.position.x + reach);
+    for (int r = first; r <= last; r++)
+      if (r != exchange.rank)
+        exchange.outgoing[r].push_back(p);
+  }
+  local.assign(owned.begin(), owned.end());
+  exchange.exchange(local);
+  std::sort(local.begin(), local.end(), lessById);
+}
+
+void gatherParticles(const std::vector<Particle>& owned,
+                     std::vector<Particle>& allParticles,
+                     ParticleExchange& exchange)
+{
+  exchange.outgoing[0].assign(owned.begin(), owned.end());
+  allParticles.clear();
+  exchange.exchange(allParticles);
+  std::sort(allParticles.begin(), allParticles.end(), lessById);
+}
+
+void computeGlobalBounds(const std::vector<Particle>& owned,
+                         Vec2& bmin, Vec2& bmax, MPI_Comm comm)
+{
+  computeBounds(owned, bmin, bmax);
+  float lo[2] = { bmin.x, bmin.y };
+  float hi[2] = { bmax.x, bmax.y };
+  MPI_Allreduce(MPI_IN_PLACE, lo, 2, MPI_FLOAT, MPI_MIN, comm);
+  MPI_Allreduce(MPI_IN_PLACE, hi, 2, MPI_FLOAT, MPI_MAX, comm);
+  bmin = Vec2(lo[0], lo[1]);
+  bmax = Vec2(hi[0], hi[1]);
+}
@@ -0,0 +1,100 @@
+#ifndef MPI_DOMAIN_H
+#define MPI_DOMAIN_H
+
+#include <mpi.h>
+#include <vector>
+#include "common.h"
+
+// Sends particles to arbitrary ranks with one MPI_Alltoallv. The buffers
+// are kept between calls so the per step exchanges do not allocate.
+class ParticleExchange
+{
+public:
+    explicit ParticleExchange(MPI_Comm comm);
+    ~ParticleExchange();
+
+    // particles to send, one list per destination rank
+    std::vector<std::vector<Particle>> outgoing;
+
+    // Sends the outgoing lists, clears them, and appends the received
+    // particles to incoming in rank order.
+    void exchange(std::vector<Particle>& incoming);
+
+    MPI_Comm comm;
+    MPI_Datatype particleType;
+    int rank = 0, numRanks = 1;
+
+private:
+    std::vector<Particle> sendBuffer;
+    std::vector<int> sendCounts, sendDispls, recvCounts, recvDispls;
+};
+
+// Splits space into one slab along x per rank. Slab r owns the particles
+// with splits[r - 1] <= x < splits[r], where the first and last slabs are
+// open ended.
+class SlabDecomposition
+{
+public:
+    std::vector<float> splits;
+
+    inline int owner(float x) const
+    {
+        // first split greater than x
+        int lo = 0, hi = (int)splits.size();
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (x < splits[mid])
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return lo;
+    }
+
+    // Sets the splits so every slab holds the same number of particles.
+    void partitionEvenly(const std::vector<Particle>& particles, int numRanks);
+};
+
+// Moves the splits so every slab carries the same total cost, where
+// cost[i] is the measured work of owned[i]. This is orthogonal recursive
+// bisection restricted to x: the splits are weighted quantiles of the
+// particle positions, found from a global histogram of cost over x. The
+// particles are not moved, migrateParticles sends them to the new owners.
+void partitionByCost(SlabDecomposition& domain,
+                     const std::vector<Particle>& owned,
+                     const std::vector<uint32_t>& cost,
+                     ParticleExchange& exchange);
+
+// Rank 0 partitions allParticles, broadcasts the splits and sends every
+// rank the particles it owns; owned is sorted by id.
+void distributeParticles(const std::vector<Particle>& allParticles,
+                         SlabDecomposition& domain,
+                         std::vector<Particle>& owned,
+                         ParticleExchange& exchange);
+
+// Sends the particles that left this rank's slab to their new owner. Owned
+// sorted by id stays sorted by id; in any other order the particles that
+// stay keep it and the arrivals are appended by id.
+void migrateParticles(const SlabDecomposition& domain,
+                      std::vector<Particle>& owned,
+                      ParticleExchange& exchange);
+
+// Fills local with the owned particles plus every particle of other ranks
+// within radius of this rank's slab, sorted by id. Any query of radius or
+// less around an owned particle then finds the same particles in local as
+// in the full particle set, in the same relative order.
+void gatherHalo(const SlabDecomposition& domain,
+                const std::vector<Particle>& owned, float radius,
+                std::vector<Particle>& local,
+                ParticleExchange& exchange);
+
+// Collects every rank's particles on rank 0, sorted by id.
+void gatherParticles(const std::vector<Particle>& owned,
+                     std::vector<Particle>& allParticles,
+                     ParticleExchange& exchange);
+
+// Global bounds of the particles owned by all ranks.
+void computeGlobalBounds(const std::vector<Particle>& owned,
+                         Vec2& bmin, Vec2& bmax, MPI_Comm comm);
+
+#endif
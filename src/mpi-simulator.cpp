@@ -1,79 +1,779 @@
 #include <sstream>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <mpi.h>
+#include <sys/stat.h>
 #include "timing.h"
 #include "common.h"
 #include "quad-tree.h"
+#include "uniform-grid.h"
+#include "force-kernel.h"
+#include "mpi-domain.h"
+#include "thread-pool.h"
+#include "neighbor-list.h"
+#include "simulate-step.h"
+#include "frame-writer.h"
+#include "counters.h"
+#include "trace.h"
+#include "scene-generator.h"
+#include "pair-forces.h"
+#include "autotune.h"
+#include "barnes-hut.h"
+#include "leaf-batch.h"
+#include "hilbert-order.h"
+#include "checkpoint.h"
 
-void simulateStep(const QuadTree& quadTree,
-                  const std::vector<Particle>& particles,
-                  std::vector<Particle>& newParticles,
-                  StepParameters params) {
-  for (int i = 0; i < (int) particles.size(); ++i) {
-    const auto& pi = particles[i];
-    std::vector<Particle> nearbyParticles;
-    quadTree.getParticles(nearbyParticles, pi.position, params.cullRadius);
-    Vec2 force = Vec2(0.0f, 0.0f);
-    for (size_t j = 0; j < nearbyParticles.size(); ++j) {
-      if (nearbyParticles[j].id == pi.id)
-        continue;
-      force += computeForce(pi, nearbyParticles[j], params.cullRadius);
-    }
-    newParticles[i] = updateParticle(pi, force, params.deltaTime);
+// background threads drawing -fo frames, and frames they can have queued
+// or in progress before the simulation waits
+const int FrameWriterThreads = 2;
+const int FrameWriterBuffers = 4;
+// steps -autotune times per tree configuration, keeping the fastest
+const int AutotuneSteps = 2;
+
+// prints the size of a particle file and the rate it was read or written at
+void reportThroughput(const char* action, const std::string& fileName,
+                      double seconds) {
+  struct stat info;
+  if (stat(fileName.c_str(), &info) != 0)
+    return;
+  double megabytes = info.st_size / (1024.0 * 1024.0);
+  printf("%s %s: %.3f MB in %.6fs, %.1f MB/s\n", action, fileName.c_str(),
+         megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+}
+
+// The reference of -self-check: runs the simulation on one thread with
+// the quad tree and no decomposition, and sorts the result by id.
+void simulateSerial(std::vector<Particle>& particles, int numIterations,
+                    StepParameters params, bool byId) {
+  QuadTree tree;
+  std::vector<Particle> newParticles(particles.size());
+  for (int i = 0; i < numIterations; i++) {
+    Vec2 bmin, bmax;
+    computeBounds(particles, bmin, bmax);
+    buildQuadTree(particles, tree, TreeBuilderType::Recursive, bmin, bmax, nullptr);
+    if (byId)
+      simulateStepById(tree, particles, newParticles, params, nullptr);
+    else
+      simulateStep(tree, particles, newParticles, params, nullptr);
+    particles.swap(newParticles);
+  }
+  // in the order of the gathered result
+  std::sort(particles.begin(), particles.end(),
+            [](const Particle& a, const Particle& b) { return a.id < b.id; });
+}
+
+// Compares two particle sets sorted by id bit for bit, and prints how far
+// apart they are if they differ.
+bool compareParticles(const std::vector<Particle>& result,
+                      const std::vector<Particle>& reference) {
+  if (result.size() != reference.size()) {
+    printf("self check: %zu particles, the serial run has %zu\n",
+           result.size(), reference.size());
+    return false;
+  }
+  size_t differing = 0;
+  float maxDistance = 0.0f;
+  for (size_t i = 0; i < result.size(); i++) {
+    const Particle& a = result[i];
+    const Particle& b = reference[i];
+    if (a.id == b.id && a.mass == b.mass &&
+        memcmp(&a.position, &b.position, sizeof(Vec2)) == 0 &&
+        memcmp(&a.velocity, &b.velocity, sizeof(Vec2)) == 0)
+      continue;
+    differing++;
+    maxDistance = std::max(maxDistance, (a.position - b.position).length());
+  }
+  if (differing > 0)
+    printf("self check: %zu particles differ, positions by up to %g\n",
+           differing, maxDistance);
+  return differing == 0;
+}
+
+// Times every tree configuration on the owned particles without advancing
+// them, and returns the fastest. The halo and the bounds are gathered once;
+// a step is the tree build and the force evaluation, timed on the slowest
+// rank so all ranks pick the same configuration.
+TreeConfig autotuneTree(const SlabDecomposition& domain,
+                        const std::vector<Particle>& particles,
+                        size_t numIds, StepParameters params,
+                        const StartupOptions& options, ThreadPool& pool,
+                        ParticleExchange& exchange, int rank) {
+  std::vector<Particle> local, newParticles(particles.size());
+  gatherHalo(domain, particles, params.cullRadius, local, exchange);
+  Vec2 bmin, bmax;
+  computeGlobalBounds(particles, bmin, bmax, MPI_COMM_WORLD);
+  QuadTree tree;
+  LeafBatchedForces leafBatch;
+  TreeConfig best;
+  double bestTime = 0.0;
+  for (const TreeConfig& config : treeConfigs()) {
+    tree.leafSize = config.leafSize;
+    tree.fanOut = config.fanOut;
+    double time = 1e30;
+    for (int s = 0; s < AutotuneSteps; s++) {
+      Timer t;
+      buildQuadTree(local, tree, options.treeBuilder, bmin, bmax, &pool);
+      if (options.deterministic)
+        simulateStepById(tree, particles, newParticles, params, &pool);
+      else if (options.leafBatch)
+        leafBatch.simulateStep(tree, particles, newParticles, params, numIds,
+                               &pool);
+      else
+        simulateStep(tree, particles, newParticles, params, &pool);
+      time = std::min(time, t.elapsed());
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &time, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    if (rank == 0)
+      printf("autotune: leaf size %d, fan-out %d: %.6fs\n", config.leafSize,
+             config.fanOut, time);
+    if (bestTime == 0.0 || time < bestTime) {
+      best = config;
+      bestTime = time;
+    }
+  }
+  return best;
+}
+
+// gathers the trace events of all ranks and writes them on rank 0
+void writeTrace(const std::string& fileName, int rank, int numRanks) {
+  std::string events = traceEventsJson();
+  int length = (int)events.size();
+  std::vector<int> lengths(numRanks), offsets(numRanks, 0);
+  MPI_Gather(&length, 1, MPI_INT, lengths.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+  std::string allEvents;
+  if (rank == 0) {
+    int total = 0;
+    for (int r = 0; r < numRanks; r++) {
+      offsets[r] = total;
+      total += lengths[r];
+    }
+    allEvents.resize(total);
+  }
+  MPI_Gatherv(&events[0], length, MPI_CHAR, &allEvents[0], lengths.data(),
+              offsets.data(), MPI_CHAR, 0, MPI_COMM_WORLD);
+  if (rank == 0) {
+    // each rank's events are a comma separated list, join them with one
+    std::string joined;
+    for (int r = 0; r < numRanks; r++) {
+      if (r > 0 && lengths[r] > 0)
+        joined += ",\n";
+      joined.append(allEvents, offsets[r], lengths[r]);
+    }
+    if (writeTraceFile(fileName, joined))
+      printf("trace of %d ranks written to %s\n", numRanks, fileName.c_str());
   }
 }
 
 int main(int argc, char *argv[]) {
+  MPI_Init(&argc, &argv);
+  int rank, numRanks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &numRanks);
+
   StartupOptions options = parseOptions(argc, argv);
+  bool selfCheckPassed = true, saved = true;
 
-  std::vector<Particle> particles, newParticles;
+  // particles and newParticles hold the particles this rank owns, local
+  // adds the halo of other ranks' particles within cullRadius of the slab
+  std::vector<Particle> particles, newParticles, local, allParticles;
+  // per owned particle cost of the last step, only recorded with -mpilb
+  std::vector<uint32_t> interactions;
+  std::vector<double> rankLoads(2 * numRanks);
 
-  if (options.inputFile.empty()) {
-    std::cerr << "Please specify input file with -in option\n";
-    exit(1);
+  // the trace starts before the pool, so its workers see it enabled
+  if (!options.traceFile.empty()) {
+    MPI_Barrier(MPI_COMM_WORLD);
+    startTrace(rank);
+    setTraceThreadName("main");
   }
 
-  loadFromFile(options.inputFile, particles);
+  setForceKernel(options.forceKernel);
+  ThreadPool pool(options.numThreads);
+
+  // a restart takes the particles and the run's parameters from the
+  // checkpoint instead of -in or the scene options
+  bool restarted = !options.restartFile.empty();
+  CheckpointState restartState = CheckpointState();
+  if (restarted) {
+    int loaded = 1;
+    if (rank == 0) {
+      TraceSpan span("restart");
+      Timer t;
+      loaded = loadCheckpoint(options.restartFile, restartState, allParticles);
+      if (loaded)
+        reportThroughput("restarted from", options.restartFile, t.elapsed());
+    }
+    MPI_Bcast(&loaded, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!loaded) {
+      MPI_Finalize();
+      return 1;
+    }
+    MPI_Bcast(&restartState, sizeof(restartState), MPI_BYTE, 0, MPI_COMM_WORLD);
+    options.spaceSize = restartState.spaceSize;
+    options.scene = (SceneType)restartState.scene;
+    options.seed = restartState.seed;
+    options.inputFile = restartState.inputFile;
+    if (rank == 0)
+      printf("resuming %s at iteration %llu of %d\n",
+             options.inputFile.empty() ? sceneTypeName(options.scene) :
+                                         options.inputFile.c_str(),
+             (unsigned long long)restartState.iteration, options.numIterations);
+  } else if (rank == 0 && options.inputFile.empty()) {
+    TraceSpan span("generate");
+    Timer t;
+    generateScene(options.scene, options.numParticles, options.spaceSize,
+                  options.seed, allParticles, &pool);
+    printf("generated %s scene of %zu particles in %.6fs, seed %llu\n",
+           sceneTypeName(options.scene), allParticles.size(), t.elapsed(),
+           options.seed);
+  } else if (rank == 0) {
+    TraceSpan span("load");
+    Timer t;
+    loadFromFile(options.inputFile, allParticles, &pool);
+    reportThroughput("loaded", options.inputFile, t.elapsed());
+  }
 
   StepParameters stepParams;
-  stepParams = getBenchmarkStepParams(options.spaceSize);
+  stepParams = getStepParams(options);
+  if (restarted) {
+    stepParams.deltaTime = restartState.deltaTime;
+    stepParams.cullRadius = restartState.cullRadius;
+  }
+  int startIteration = restarted ? (int)restartState.iteration : 0;
+
+  {
+    ParticleExchange exchange(MPI_COMM_WORLD);
+    SlabDecomposition domain;
+    {
+      TraceSpan span("distribute");
+      distributeParticles(allParticles, domain, particles, exchange);
+    }
+    // the initial particles of the -self-check run
+    std::vector<Particle> initialParticles;
+    if (rank == 0 && options.selfCheck)
+      initialParticles = allParticles;
+    long long numParticles = (long long)allParticles.size();
+    MPI_Bcast(&numParticles, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
 
-  double totalTreeBuildingTime = 0;
-  double totalSimulationTime = 0;
-  newParticles.resize(particles.size());
-  for (int i = 0; i < options.numIterations; i++) {
+    double totalTreeBuildingTime = 0;
+    double totalSimulationTime = 0;
+    double totalCommunicationTime = 0;
+    // this rank's own share of the totals above
+    double rankComputeTime = 0, rankCommunicationTime = 0;
+    // kept across iterations so the node and particle arrays are reused
     QuadTree tree;
-    Timer t;
-    buildQuadTree(particles, tree);
-    double treeBuildingTime = t.elapsed();
+    UniformGrid grid;
+    // pair forces need the grid with cells of cullRadius; the Verlet lists
+    // and the id ordered sums evaluate every particle on its own
+    bool usePairs = options.pairForces && options.verletSkin <= 0.0f &&
+                    !options.deterministic;
+    if (rank == 0 && options.pairForces && !usePairs)
+      std::cerr << "-pair-forces is ignored with -verlet-skin and -deterministic\n";
+    PairForces pairForces;
+    uint64_t pairsEvaluated = 0;
+    bool useGrid = options.spatialIndex == SpatialIndexType::UniformGrid || usePairs;
+    bool loadBalance = options.simulatorType == SimulatorType::MPILB;
+    // Barnes-Hut approximates the tree queries of simulateStep; the first
+    // step is also evaluated exactly, for the error and the speedup
+    bool useBarnesHut = options.theta > 0.0f && !useGrid &&
+                        options.verletSkin <= 0.0f && !options.deterministic;
+    if (rank == 0 && options.theta > 0.0f && !useBarnesHut)
+      std::cerr << "-theta is ignored with -index grid, -pair-forces, -verlet-skin and -deterministic\n";
+    // leaf batching replaces the per particle queries of simulateStep
+    bool useLeafBatch = options.leafBatch && !useGrid && !useBarnesHut &&
+                        options.verletSkin <= 0.0f && !options.deterministic;
+    if (rank == 0 && options.leafBatch && !useLeafBatch)
+      std::cerr << "-leaf-batch is ignored with -index grid, -pair-forces, -verlet-skin, -deterministic and -theta\n";
+    LeafBatchedForces leafBatch;
+    // the first step runs in input order, the following ones are reordered
+    bool reorder = options.reorderInterval > 0;
+    int numReorders = 0;
+    double reorderTime = 0.0, gapAfterReorder = 0.0;
+    double inputOrderGap = 0.0, firstReorderGap = 0.0;
+    double inputOrderStepTime = 0.0, reorderedStepTime = 0.0;
+    int reorderedSteps = 0;
+    ForceError barnesHutError;
+    double barnesHutStepTime = 0.0, exactStepTime = 0.0;
+    // slack bounds of the incrementally updated tree
+    Vec2 treeBMin, treeBMax;
+    bool treeBoundsSet = restarted && restartState.treeBoundsSet;
+    if (treeBoundsSet) {
+      treeBMin = Vec2(restartState.treeBMin[0], restartState.treeBMin[1]);
+      treeBMax = Vec2(restartState.treeBMax[0], restartState.treeBMax[1]);
+    }
+    long long numTreeBuilds = 0, numTreeUpdates = 0, movedParticles = 0;
+    bool useLists = options.verletSkin > 0.0f;
+    const float skin = options.verletSkin;
+    NeighborList lists;
+    // indices of the local particles that get a list, and the local index
+    // of every id; stale entries of the latter are caught by an id check.
+    // Indexed by id, so ids must be dense in [0, numParticles), as they
+    // are for loaded and generated scenes.
+    std::vector<uint32_t> listRows;
+    std::vector<int> localIndexOfId(useLists ? numParticles : 0, -1);
+    int numListBuilds = 0;
+    // steps since the last list build, to warn once when lists cannot
+    // outlast a single step
+    int stepsSinceListBuild = 0;
+    bool warnedShortLists = false;
+    // set by a checkpoint, which the lists are rebuilt after, see checkpoint.h
+    bool listsStale = false;
+    // rank 0 writes the checkpoints off the critical path
+    std::unique_ptr<CheckpointWriter> checkpointWriter;
+    if (rank == 0 && options.checkpointInterval > 0)
+      checkpointWriter.reset(new CheckpointWriter());
+    // rank 0 draws the frames off the critical path
+    std::unique_ptr<FrameWriter> frameWriter;
+    if (rank == 0 && options.frameOutputStyle == FrameOutputStyle::AllFrames)
+      frameWriter.reset(new FrameWriter(options.viewportRadius, FrameWriterThreads,
+                                        FrameWriterBuffers));
+    int numRebalances = 0;
+    bool countCounters = CountersEnabled &&
+                         options.counterFormat != CounterFormat::None;
+    if (rank == 0 && !CountersEnabled && options.counterFormat != CounterFormat::None)
+      std::cerr << "-counters needs a build with counters, make COUNTERS=1\n";
+    float gridCellSize = usePairs ? stepParams.cullRadius :
+                         stepParams.cullRadius / std::max(options.gridCellsPerRadius, 1);
+    if (isQuadTreeLeafSize(options.leafSize) &&
+        (options.fanOut == 4 || options.fanOut == 16)) {
+      tree.leafSize = options.leafSize;
+      tree.fanOut = options.fanOut;
+    } else if (rank == 0) {
+      std::cerr << "-leaf-size must be 4, 8, 16, 32 or 64 and -fan-out 4 or 16\n";
+    }
+    // leaf size and fan-out only matter to the tree queries of the step
+    bool tuneTree = !useGrid && !useLists;
+    if (rank == 0 && options.autotune && !tuneTree)
+      std::cerr << "-autotune is ignored with -index grid, -pair-forces and -verlet-skin\n";
+    if (restarted) {
+      // the leaf size shapes the Barnes-Hut nodes, so the checkpoint's wins
+      if (isQuadTreeLeafSize((int)restartState.leafSize))
+        tree.leafSize = (int)restartState.leafSize;
+      if (restartState.fanOut == 4 || restartState.fanOut == 16)
+        tree.fanOut = (int)restartState.fanOut;
+    } else if (options.autotune && tuneTree) {
+      TraceSpan span("autotune");
+      std::string signature;
+      // whether the cache had the signature, and its configuration
+      int cached[3] = { 0, 0, 0 };
+      if (rank == 0) {
+        std::string engine = options.treeBuilder == TreeBuilderType::Morton ?
+                             "tree=morton" : "tree=recursive";
+        if (options.deterministic)
+          engine += " deterministic";
+        else if (options.leafBatch)
+          engine += " leaf-batch";
+        signature = sceneSignature(allParticles, stepParams.cullRadius, numRanks,
+                                   options.numThreads, engine);
+        TreeConfig config;
+        if (findTreeConfig(options.autotuneCache, signature, config)) {
+          cached[0] = 1;
+          cached[1] = config.leafSize;
+          cached[2] = config.fanOut;
+        }
+      }
+      MPI_Bcast(cached, 3, MPI_INT, 0, MPI_COMM_WORLD);
+      TreeConfig config;
+      if (cached[0]) {
+        config.leafSize = cached[1];
+        config.fanOut = cached[2];
+      } else {
+        Timer t;
+        config = autotuneTree(domain, particles, numParticles, stepParams,
+                              options, pool, exchange, rank);
+        if (rank == 0) {
+          printf("autotune took %.6fs\n", t.elapsed());
+          saveTreeConfig(options.autotuneCache, signature, config);
+        }
+      }
+      tree.leafSize = config.leafSize;
+      tree.fanOut = config.fanOut;
+      if (rank == 0)
+        printf("autotune: using leaf size %d, fan-out %d%s (%s)\n",
+               config.leafSize, config.fanOut,
+               cached[0] ? ", cached" : "", signature.c_str());
+    }
+    for (int i = startIteration; i < options.numIterations; i++) {
+      double iterationReorderTime = 0.0;
+      if (reorder) {
+        double gap = meanNeighborGap(particles);
+        if (i == 0)
+          inputOrderGap = gap;
+        if (i > 0 && ((i - 1) % options.reorderInterval == 0 ||
+                      gap > options.reorderThreshold * gapAfterReorder)) {
+          TraceSpan span("reorder");
+          Timer t;
+          sortByHilbert(particles, newParticles);
+          iterationReorderTime = t.elapsed();
+          reorderTime += iterationReorderTime;
+          gapAfterReorder = meanNeighborGap(particles);
+          if (numReorders++ == 0)
+            firstReorderGap = gapAfterReorder;
+        }
+      }
+      Timer t;
+      // all ranks rebuild the lists together, once any particle moved more
+      // than skin / 2, so when they do does not depend on the partition
+      bool rebuildLists = false;
+      if (useLists) {
+        TraceSpan span("list check");
+        float displacement = lists.built && !listsStale ?
+                             lists.maxDisplacement(particles) : 1e30f;
+        MPI_Allreduce(MPI_IN_PLACE, &displacement, 1, MPI_FLOAT, MPI_MAX,
+                      MPI_COMM_WORLD);
+        rebuildLists = displacement > 0.5f * skin;
+        stepsSinceListBuild++;
+        // lists rebuilt every step only add their build to the queries
+        if (rebuildLists && stepsSinceListBuild == 1 && lists.built &&
+            !listsStale && !warnedShortLists && rank == 0) {
+          // a particle that migrated past the listed halo has no distance
+          std::cerr << "-verlet-skin " << skin << ": the lists did not last "
+                    << "one step";
+          if (displacement < 1e30f)
+            std::cerr << ", a particle moved " << displacement
+                      << ", more than skin / 2";
+          std::cerr << "; lists rebuilt every step are slower than plain "
+                    << "queries, use a larger skin or none\n";
+          warnedShortLists = true;
+        }
+      }
+      bool buildIndex = !useLists || rebuildLists;
+      // a rebuild lists the particles up to skin / 2 outside the slab, which
+      // may migrate here before the next one, and needs their neighbors
+      float haloRadius = stepParams.cullRadius + (rebuildLists ? 1.5f * skin : 0.0f);
+      {
+        TraceSpan span("halo exchange");
+        gatherHalo(domain, particles, haloRadius, local, exchange);
+      }
+      // every rank builds its part of the global grid or tree, so neighbors
+      // are visited in the same order as in a single process run
+      Vec2 bmin, bmax;
+      if (buildIndex) {
+        TraceSpan span("bounds");
+        computeGlobalBounds(particles, bmin, bmax, MPI_COMM_WORLD);
+      }
+      double communicationTime = t.elapsed();
 
-    t.reset();
-    simulateStep(tree, particles, newParticles, stepParams);
-    double simulateStepTime = t.elapsed();
-    particles.swap(newParticles);
+      // all ranks see the same global bounds, so they agree on the slack
+      // bounds and on when to reset them
+      if (buildIndex && options.incrementalTree) {
+        if (!treeBoundsSet || bmin.x < treeBMin.x || bmin.y < treeBMin.y ||
+            bmax.x > treeBMax.x || bmax.y > treeBMax.y) {
+          Vec2 margin = (bmax - bmin) * options.treeSlack;
+          treeBMin = bmin - margin;
+          treeBMax = bmax + margin;
+          treeBoundsSet = true;
+        }
+        bmin = treeBMin;
+        bmax = treeBMax;
+      }
+
+      t.reset();
+      if (buildIndex) {
+        TraceSpan span(useGrid ? "grid build" : "tree build");
+        if (useGrid)
+          buildUniformGrid(local, grid, gridCellSize, bmin, bmax, numParticles);
+        else if (options.incrementalTree)
+          updateQuadTree(local, tree, options.treeBuilder, bmin, bmax, &pool);
+        else
+          buildQuadTree(local, tree, options.treeBuilder, bmin, bmax, &pool);
+        if (useBarnesHut)
+          tree.computeMoments();
+        if (useGrid)
+          grid.countLeaves();
+        else
+          tree.countLeaves();
+        if (!useGrid) {
+          (tree.updated ? numTreeUpdates : numTreeBuilds)++;
+          movedParticles += tree.movedParticles;
+        }
+      }
+      if (rebuildLists) {
+        TraceSpan span("neighbor lists");
+        float reach = 0.5f * skin * 1.0001f;
+        listRows.clear();
+        for (uint32_t j = 0; j < (uint32_t)local.size(); j++) {
+          float x = local[j].position.x;
+          if (domain.owner(x - reach) <= rank && rank <= domain.owner(x + reach))
+            listRows.push_back(j);
+        }
+        if (useGrid)
+          lists.build(grid, local, listRows, stepParams.cullRadius, skin,
+                      numParticles, &pool);
+        else
+          lists.build(tree, local, listRows, stepParams.cullRadius, skin,
+                      numParticles, &pool);
+        numListBuilds++;
+        stepsSinceListBuild = 0;
+        listsStale = false;
+      }
+      if (useLists)
+        for (int j = 0; j < (int)local.size(); j++)
+          localIndexOfId[local[j].id] = j;
+      double treeBuildingTime = t.elapsed() + iterationReorderTime;
+
+      t.reset();
+      newParticles.resize(particles.size());
+      interactions.resize(loadBalance ? particles.size() : 0);
+      {
+        // forces and the particle update, chunks are traced by thread
+        TraceSpan span("simulate step");
+        if (useLists)
+          simulateStepVerlet(lists, local, localIndexOfId, particles, newParticles,
+                             stepParams, &pool, interactions.data(),
+                             options.deterministic);
+        else if (usePairs) {
+          pairForces.simulateStep(grid, particles, newParticles, stepParams,
+                                  numParticles, &pool, interactions.data());
+          pairsEvaluated += pairForces.pairsEvaluated;
+        }
+        else if (useBarnesHut)
+          simulateStepBarnesHut(tree, particles, newParticles, stepParams,
+                                options.theta, &pool, interactions.data());
+        else if (useLeafBatch)
+          leafBatch.simulateStep(tree, particles, newParticles, stepParams,
+                                 numParticles, &pool, interactions.data());
+        else if (options.deterministic && useGrid)
+          simulateStepById(grid, particles, newParticles, stepParams, &pool,
+                           interactions.data());
+        else if (options.deterministic)
+          simulateStepById(tree, particles, newParticles, stepParams, &pool,
+                           interactions.data());
+        else if (useGrid)
+          simulateStep(grid, particles, newParticles, stepParams, &pool,
+                       interactions.data());
+        else
+          simulateStep(tree, particles, newParticles, stepParams, &pool,
+                       interactions.data());
+      }
+      double simulateStepTime = t.elapsed();
+      if (useBarnesHut && i == 0) {
+        TraceSpan span("exact step");
+        std::vector<Particle> exactParticles(particles.size());
+        t.reset();
+        simulateStep(tree, particles, exactParticles, stepParams, &pool);
+        exactStepTime = t.elapsed();
+        barnesHutStepTime = simulateStepTime;
+        barnesHutError.add(particles, newParticles, exactParticles);
+      }
+      particles.swap(newParticles);
+
+      t.reset();
+      if (loadBalance) {
+        TraceSpan span("load balance");
+        // the interaction counts are exact, so every rank computes the same
+        // imbalance and agrees on when to repartition
+        double load = 0;
+        for (uint32_t count : interactions)
+          load += count;
+        double rankLoad[2] = { load, treeBuildingTime + simulateStepTime };
+        MPI_Allgather(rankLoad, 2, MPI_DOUBLE, rankLoads.data(), 2, MPI_DOUBLE,
+                      MPI_COMM_WORLD);
+        double maxLoad = 0, totalLoad = 0;
+        for (int r = 0; r < numRanks; r++) {
+          maxLoad = std::max(maxLoad, rankLoads[2 * r]);
+          totalLoad += rankLoads[2 * r];
+        }
+        double imbalance = totalLoad > 0 ? maxLoad * numRanks / totalLoad : 1.0;
+        bool rebalance = imbalance > options.loadBalanceThreshold ||
+                         (options.loadBalanceInterval > 0 &&
+                          (i + 1) % options.loadBalanceInterval == 0);
+        if (rank == 0) {
+          printf("iteration %d, load imbalance: %.3f%s\n", i, imbalance,
+                 rebalance ? ", repartitioning" : "");
+          for (int r = 0; r < numRanks; r++)
+            printf("  rank %d: interactions %.0f, compute %.6fms\n",
+                   r, rankLoads[2 * r], rankLoads[2 * r + 1]);
+        }
+        if (rebalance) {
+          partitionByCost(domain, particles, interactions, exchange);
+          numRebalances++;
+        }
+      }
+      {
+        TraceSpan span("migrate");
+        migrateParticles(domain, particles, exchange);
+      }
+      communicationTime += t.elapsed();
+
+      rankComputeTime += treeBuildingTime + simulateStepTime;
+      rankCommunicationTime += communicationTime;
+
+      // the slowest rank sets the pace of the step
+      double times[3] = { treeBuildingTime, simulateStepTime, communicationTime };
+      MPI_Reduce(rank == 0 ? MPI_IN_PLACE : times, times, 3, MPI_DOUBLE, MPI_MAX,
+                 0, MPI_COMM_WORLD);
+      treeBuildingTime = times[0];
+      simulateStepTime = times[1];
+      communicationTime = times[2];
 
-    totalTreeBuildingTime += treeBuildingTime;
-    totalSimulationTime += simulateStepTime;
+      totalTreeBuildingTime += treeBuildingTime;
+      totalSimulationTime += simulateStepTime;
+      (i == 0 ? inputOrderStepTime : reorderedStepTime) += simulateStepTime;
+      reorderedSteps += i > 0;
+      totalCommunicationTime += communicationTime;
 
-    printf("iteration %d, tree construction: %.6fms, simulation: %.6fms\n",
-           i, treeBuildingTime, simulateStepTime);
+      if (rank == 0)
+        printf("iteration %d, tree construction: %.6fms, simulation: %.6fms, communication: %.6fms\n",
+               i, treeBuildingTime, simulateStepTime, communicationTime);
 
-    // generate simulation image
-    if (options.frameOutputStyle == FrameOutputStyle::AllFrames) {
-      std::stringstream sstream;
-      sstream << options.bitmapOutputDir;
-      if (!options.bitmapOutputDir.size() || (options.bitmapOutputDir.back() != '\\' &&
-                                              options.bitmapOutputDir.back() != '/'))
-        sstream << "/";
-      sstream << i << ".bmp";
-      dumpView(sstream.str(), options.viewportRadius, particles);
+      if (countCounters) {
+        HotPathCounters counters;
+        collectCounters(counters);
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &counters, &counters,
+                   sizeof(counters) / sizeof(uint64_t), MPI_UINT64_T, MPI_SUM, 0,
+                   MPI_COMM_WORLD);
+        if (rank == 0)
+          printCounters(stdout, options.counterFormat, i, counters);
+      }
+
+      // generate simulation image
+      if (options.frameOutputStyle == FrameOutputStyle::AllFrames) {
+        TraceSpan span("frame gather");
+        gatherParticles(particles, allParticles, exchange);
+        if (rank == 0) {
+          std::stringstream sstream;
+          sstream << options.bitmapOutputDir;
+          if (!options.bitmapOutputDir.size() || (options.bitmapOutputDir.back() != '\\' &&
+                                                  options.bitmapOutputDir.back() != '/'))
+            sstream << "/";
+          sstream << i << ".bmp";
+          double stalled = frameWriter->queueFrame(sstream.str(), allParticles);
+          if (stalled > 0)
+            printf("iteration %d, frame output stalled the simulation for %.6fms\n",
+                   i, stalled);
+        }
+      }
+
+      if (options.checkpointInterval > 0 && (i + 1) % options.checkpointInterval == 0) {
+        TraceSpan span("checkpoint gather");
+        gatherParticles(particles, allParticles, exchange);
+        if (rank == 0) {
+          CheckpointState state = CheckpointState();
+          state.iteration = (uint64_t)(i + 1);
+          state.numParticles = allParticles.size();
+          state.deltaTime = stepParams.deltaTime;
+          state.cullRadius = stepParams.cullRadius;
+          state.spaceSize = options.spaceSize;
+          state.scene = (uint32_t)options.scene;
+          state.seed = options.seed;
+          state.treeBoundsSet = treeBoundsSet;
+          state.treeBMin[0] = treeBMin.x;
+          state.treeBMin[1] = treeBMin.y;
+          state.treeBMax[0] = treeBMax.x;
+          state.treeBMax[1] = treeBMax.y;
+          state.leafSize = (uint32_t)tree.leafSize;
+          state.fanOut = (uint32_t)tree.fanOut;
+          strncpy(state.inputFile, options.inputFile.c_str(),
+                  sizeof(state.inputFile) - 1);
+          double stalled = checkpointWriter->queue(options.checkpointFile, state,
+                                                   allParticles);
+          if (stalled > 0)
+            printf("iteration %d, checkpoint output stalled the simulation for %.6fms\n",
+                   i, stalled);
+        }
+        listsStale = true;
+      }
+    }
+
+    if (frameWriter) {
+      Timer t;
+      frameWriter->finish();
+      printf("frames: %d written, %d stalls for %.6fms, %.6fms waiting for the last frames\n",
+             frameWriter->framesQueued, frameWriter->stalls, frameWriter->stallTime,
+             t.elapsed());
+    }
+    if (checkpointWriter) {
+      Timer t;
+      checkpointWriter->finish();
+      printf("checkpoints: %d written to %s, %d failed, %d stalls for %.6fms, "
+             "%.6fms writing in the background, %.6fms waiting for the last\n",
+             checkpointWriter->written, options.checkpointFile.c_str(),
+             checkpointWriter->failures, checkpointWriter->stalls,
+             checkpointWriter->stallTime, checkpointWriter->writeTime, t.elapsed());
+    }
+
+    double rankTimes[3] = { rankComputeTime, rankCommunicationTime,
+                            (double)particles.size() };
+    std::vector<double> allRankTimes(3 * numRanks);
+    MPI_Gather(rankTimes, 3, MPI_DOUBLE, allRankTimes.data(), 3, MPI_DOUBLE, 0,
+               MPI_COMM_WORLD);
+
+    double listBytes = (double)lists.memoryBytes();
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &listBytes, &listBytes, 1, MPI_DOUBLE,
+               MPI_MAX, 0, MPI_COMM_WORLD);
+    double stepTimes[2] = { barnesHutStepTime, exactStepTime };
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : stepTimes, stepTimes, 2, MPI_DOUBLE,
+               MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &barnesHutError.sumSquared,
+               &barnesHutError.sumSquared, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &barnesHutError.max, &barnesHutError.max,
+               1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &barnesHutError.count,
+               &barnesHutError.count, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    unsigned long long totalPairs = pairsEvaluated;
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &totalPairs, &totalPairs, 1,
+               MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+    if (rank == 0) {
+      printf("TOTAL TIME: %.6fms\ntotal tree construction time: %.6fms\ntotal simulation time: %.6fms\n",
+             totalTreeBuildingTime + totalSimulationTime + totalCommunicationTime,
+             totalTreeBuildingTime,
+             totalSimulationTime);
+      printf("total communication time: %.6fms\n", totalCommunicationTime);
+      if (loadBalance)
+        printf("repartitions: %d\n", numRebalances);
+      if (options.incrementalTree)
+        printf("rank 0 tree: %lld full builds, %lld updates, %lld particles moved leaf\n",
+               numTreeBuilds, numTreeUpdates, movedParticles);
+      if (useLists)
+        printf("neighbor lists: %d builds in %d iterations, %.3f MB per rank at most\n",
+               numListBuilds, options.numIterations - startIteration, listBytes / (1024.0 * 1024.0));
+      if (usePairs)
+        printf("pair forces: %llu pairs evaluated\n", totalPairs);
+      if (reorder)
+        printf("hilbert reorder: %d sorts on rank 0 in %.6fs, neighbor gap %.4g "
+               "in input order, %.4g after the first sort; simulation %.6fs "
+               "for the first step, %.6fs per reordered step\n", numReorders,
+               reorderTime, inputOrderGap, firstReorderGap, inputOrderStepTime,
+               reorderedSteps > 0 ? reorderedStepTime / reorderedSteps : 0.0);
+      if (useBarnesHut && startIteration == 0 && options.numIterations > 0)
+        printf("barnes-hut theta %g, first step: relative force error rms %.3e, "
+               "max %.3e; %.6fs against %.6fs exact, speedup %.2f\n",
+               options.theta, barnesHutError.rms(), barnesHutError.max,
+               stepTimes[0], stepTimes[1],
+               stepTimes[0] > 0 ? stepTimes[1] / stepTimes[0] : 0.0);
+      for (int r = 0; r < numRanks; r++)
+        printf("rank %d: compute %.6fms, communication %.6fms, particles %d\n",
+               r, allRankTimes[3 * r], allRankTimes[3 * r + 1],
+               (int)allRankTimes[3 * r + 2]);
+    }
+
+    gatherParticles(particles, allParticles, exchange);
+    if (rank == 0) {
+      TraceSpan span("save");
+      Timer t;
+      saved = saveToFile(options.outputFile, allParticles, &pool);
+      if (saved)
+        reportThroughput("saved", options.outputFile, t.elapsed());
+    }
+    if (rank == 0 && options.selfCheck) {
+      TraceSpan span("self check");
+      Timer t;
+      simulateSerial(initialParticles, options.numIterations - startIteration,
+                     stepParams, options.deterministic);
+      selfCheckPassed = compareParticles(allParticles, initialParticles);
+      printf("self check against a serial run: %s, %.6fs\n",
+             selfCheckPassed ? "identical" : "DIFFERENT", t.elapsed());
     }
   }
 
-  printf("TOTAL TIME: %.6fms\ntotal tree construction time: %.6fms\ntotal simulation time: %.6fms\n",
-         totalTreeBuildingTime + totalSimulationTime,
-         totalTreeBuildingTime,
-         totalSimulationTime);
+  if (!options.traceFile.empty())
+    writeTrace(options.traceFile, rank, numRanks);
 
-  saveToFile(options.outputFile, particles);
+  MPI_Finalize();
+  return selfCheckPassed && saved ? 0 : 1;
 }
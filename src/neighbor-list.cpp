@@ -0,0 +1,59 @@
+#include "neighbor-list.h"
+
+void NeighborList::clearRows()
+{
+  // only the ids listed last time have a row to reset
+  for (int id : rowIds)
+    rowOfId[id] = -1;
+  built = false;
+}
+
+void NeighborList::finishBuild(uint32_t numChunks, ThreadPool* pool)
+{
+  // chunk counts become the offset of each chunk in neighborIds
+  uint32_t total = 0;
+  for (uint32_t c = 0; c < numChunks; c++) {
+    uint32_t count = chunkCounts[c];
+    chunkCounts[c] = total;
+    total += count;
+  }
+  chunkCounts[numChunks] = total;
+  const uint32_t n = numRows();
+  neighborIds.resize(total);
+  parallelFor(pool, numChunks, [&](uint32_t firstChunk, uint32_t lastChunk) {
+    for (uint32_t c = firstChunk; c < lastChunk; c++) {
+      uint32_t begin = c * NeighborListChunkSize;
+      uint32_t end = std::min(begin + NeighborListChunkSize, n);
+      for (uint32_t r = begin; r < end; r++)
+        rowBegin[r] += chunkCounts[c];
+      std::copy(chunkNeighbors[c].begin(), chunkNeighbors[c].end(),
+                neighborIds.begin() + chunkCounts[c]);
+    }
+  }, 1);
+  rowBegin[n] = total;
+  built = true;
+}
+
+float NeighborList::maxDisplacement(const std::vector<Particle>& particles) const
+{
+  float result = 0.0f;
+  for (auto& p : particles) {
+    int row = p.id < (int)rowOfId.size() ? rowOfId[p.id] : -1;
+    if (row < 0)
+      return 1e30f;
+    result = std::max(result, (p.position - buildPositions[row]).length());
+  }
+  return result;
+}
+
+size_t NeighborList::memoryBytes() const
+{
+  size_t bytes = rowOfId.capacity() * sizeof(int) +
+                 rowBegin.capacity() * sizeof(uint32_t) +
+                 neighborIds.capacity() * sizeof(int) +
+                 rowIds.capacity() * sizeof(int) +
+                 buildPositions.capacity() * sizeof(Vec2);
+  for (auto& chunk : chunkNeighbors)
+    bytes += chunk.capacity() * sizeof(int);
+  return bytes;
+}
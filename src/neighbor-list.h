@@ -0,0 +1,108 @@
+#ifndef NEIGHBOR_LIST_H
+#define NEIGHBOR_LIST_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "common.h"
+#include "thread-pool.h"
+
+// Verlet neighbor lists: every listed particle stores the ids of all
+// particles within cullRadius + skin of it, found with one spatial index
+// query. As long as no particle has moved more than skin / 2 since then,
+// any pair now closer than cullRadius is still in the lists, so the force
+// loop can use them instead of querying again.
+//
+// Lists are in compressed sparse row form. Neighbors are stored by id, not
+// by index, because the halo a rank holds changes every step; they are
+// kept in the order of the index query, so the summation order does not
+// depend on which ranks hold the particles.
+class NeighborList
+{
+public:
+    // row of each particle id, -1 for particles without a list; indexed by
+    // id, so ids must be dense in [0, numIds) of build
+    std::vector<int> rowOfId;
+    // neighbors of row r are neighborIds[rowBegin[r], rowBegin[r + 1])
+    std::vector<uint32_t> rowBegin;
+    std::vector<int> neighborIds;
+    // id and position at build time of every row's particle
+    std::vector<int> rowIds;
+    std::vector<Vec2> buildPositions;
+    float skin = 0.0f;
+    bool built = false;
+
+    uint32_t numRows() const { return (uint32_t)buildPositions.size(); }
+
+    // Largest distance a particle moved since the build, or a huge value if
+    // some particle has no list.
+    float maxDisplacement(const std::vector<Particle>& particles) const;
+
+    // Bytes allocated by the lists, including the per id row table.
+    size_t memoryBytes() const;
+
+    // Lists the particles particles[rows[k]] with the neighbors index finds
+    // within cullRadius + skin. numIds bounds the particle ids.
+    template <typename SpatialIndex>
+    void build(const SpatialIndex& index,
+               const std::vector<Particle>& particles,
+               const std::vector<uint32_t>& rows, float cullRadius,
+               float skin, size_t numIds, ThreadPool* pool);
+
+private:
+    // neighbors found by each chunk of rows, concatenated after the queries
+    std::vector<std::vector<int>> chunkNeighbors;
+    std::vector<uint32_t> chunkCounts;
+
+    void clearRows();
+    void finishBuild(uint32_t numChunks, ThreadPool* pool);
+};
+
+// rows per chunk of a parallel build
+const uint32_t NeighborListChunkSize = 256;
+
+template <typename SpatialIndex>
+void NeighborList::build(const SpatialIndex& index,
+                         const std::vector<Particle>& particles,
+                         const std::vector<uint32_t>& rows, float cullRadius,
+                         float skin, size_t numIds, ThreadPool* pool)
+{
+    clearRows();
+    rowOfId.resize(numIds, -1);
+    this->skin = skin;
+    const uint32_t n = (uint32_t)rows.size();
+    rowIds.resize(n);
+    buildPositions.resize(n);
+    rowBegin.resize(n + 1);
+    uint32_t numChunks = (n + NeighborListChunkSize - 1) / NeighborListChunkSize;
+    if (chunkNeighbors.size() < numChunks)
+        chunkNeighbors.resize(numChunks);
+    chunkCounts.resize(numChunks + 1);
+
+    // padded so rounding never drops a pair the force test would accept
+    float radius = (cullRadius + skin) * 1.0001f;
+    parallelFor(pool, numChunks, [&](uint32_t firstChunk, uint32_t lastChunk) {
+        for (uint32_t chunk = firstChunk; chunk < lastChunk; chunk++) {
+            std::vector<int>& found = chunkNeighbors[chunk];
+            found.clear();
+            uint32_t begin = chunk * NeighborListChunkSize;
+            uint32_t end = std::min(begin + NeighborListChunkSize, n);
+            for (uint32_t r = begin; r < end; r++) {
+                const Particle& p = particles[rows[r]];
+                rowOfId[p.id] = (int)r;
+                rowIds[r] = p.id;
+                buildPositions[r] = p.position;
+                // offsets within the chunk, finishBuild makes them global
+                rowBegin[r] = (uint32_t)found.size();
+                index.forEachParticle(p.position, radius,
+                                      [&](const Particle& q) {
+                    found.push_back(q.id);
+                });
+            }
+            chunkCounts[chunk] = (uint32_t)found.size();
+        }
+    }, 1);
+    finishBuild(numChunks, pool);
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include "pair-forces.h"
+#include <atomic>
+#include "force-kernel.h"
+#include "thread-pool.h"
+#include "trace.h"
+
+// the half shell: east, north-west, north and north-east
+static const int HalfShell[4][2] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+
+void PairForces::simulateStep(const UniformGrid& grid,
+                              const std::vector<Particle>& particles,
+                              std::vector<Particle>& newParticles,
+                              StepParameters params, size_t numIds,
+                              ThreadPool* pool, uint32_t* interactions)
+{
+  const uint32_t n = (uint32_t)grid.particles.size();
+  const uint32_t numCells = (uint32_t)grid.cellsX * (uint32_t)grid.cellsY;
+  forceX.assign(n, 0.0f);
+  forceY.assign(n, 0.0f);
+  pairCount.assign(n, 0);
+  cellNeeded.assign(numCells, 0);
+  // entries of ids not in the grid are stale, but only ids in it are read
+  gridIndexOfId.resize(numIds);
+  for (uint32_t k = 0; k < n; k++)
+    gridIndexOfId[grid.particles[k].id] = (int)k;
+  for (auto& p : particles)
+    cellNeeded[grid.cellY(p.position.y) * grid.cellsX + grid.cellX(p.position.x)] = 1;
+
+  // forces between the particles [begin, end) of one cell and those of
+  // another, or of one cell among themselves, each pair once
+  const ParticleSoA& soa = grid.particlesSoA;
+  auto pairRanges = [&](uint32_t begin, uint32_t end, uint32_t otherBegin,
+                        uint32_t otherEnd, bool sameCell) {
+    uint64_t pairs = 0;
+    for (uint32_t i = begin; i < end; i++) {
+      uint32_t first = sameCell ? i + 1 : otherBegin;
+      if (first >= otherEnd)
+        continue;
+      Vec2 force = Vec2(0.0f, 0.0f);
+      accumulatePairForces(grid.particles[i], soa.positionX.data() + first,
+                           soa.positionY.data() + first, soa.mass.data() + first,
+                           otherEnd - first, params.cullRadius, force,
+                           forceX.data() + first, forceY.data() + first);
+      forceX[i] += force.x;
+      forceY[i] += force.y;
+      pairCount[i] += otherEnd - first;
+      for (uint32_t j = first; j < otherEnd; j++)
+        pairCount[j]++;
+      pairs += otherEnd - first;
+    }
+    return pairs;
+  };
+
+  std::atomic<uint64_t> totalPairs(0);
+  for (int color = 0; color < 6; color++) {
+    colorCells.clear();
+    for (int y = color / 3; y < grid.cellsY; y += 2)
+      for (int x = color % 3; x < grid.cellsX; x += 3)
+        colorCells.push_back(y * grid.cellsX + x);
+    parallelFor(pool, (uint32_t)colorCells.size(), [&](uint32_t begin, uint32_t end) {
+      TraceSpan span("pair cells");
+      uint64_t pairs = 0;
+      for (uint32_t k = begin; k < end; k++) {
+        uint32_t cell = colorCells[k];
+        int x = cell % grid.cellsX, y = cell / grid.cellsX;
+        uint32_t cellBegin = grid.cellBegin[cell], cellEnd = grid.cellBegin[cell + 1];
+        if (cellBegin == cellEnd)
+          continue;
+        if (cellNeeded[cell])
+          pairs += pairRanges(cellBegin, cellEnd, cellBegin, cellEnd, true);
+        for (auto& offset : HalfShell) {
+          int nx = x + offset[0], ny = y + offset[1];
+          if (nx < 0 || nx >= grid.cellsX || ny >= grid.cellsY)
+            continue;
+          uint32_t other = ny * grid.cellsX + nx;
+          if (cellNeeded[cell] || cellNeeded[other])
+            pairs += pairRanges(cellBegin, cellEnd, grid.cellBegin[other],
+                                grid.cellBegin[other + 1], false);
+        }
+      }
+      totalPairs += pairs;
+    }, 1);
+  }
+  pairsEvaluated = totalPairs;
+
+  parallelFor(pool, (uint32_t)particles.size(), [&](uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      const Particle& p = particles[i];
+      int k = gridIndexOfId[p.id];
+      if (interactions)
+        interactions[i] = pairCount[k];
+      newParticles[i] = updateParticle(p, Vec2(forceX[k], forceY[k]),
+                                       params.deltaTime);
+    }
+  });
+}
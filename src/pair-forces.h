@@ -0,0 +1,51 @@
+#ifndef PAIR_FORCES_H
+#define PAIR_FORCES_H
+
+#include <cstdint>
+#include <vector>
+#include "common.h"
+#include "uniform-grid.h"
+
+class ThreadPool;
+
+// Force evaluation by pairs: computeForce(a, b) and computeForce(b, a)
+// only differ in sign and rounding, so every pair within cullRadius is
+// evaluated once and its force applied to both particles.
+//
+// The pairs are found on a uniform grid with cells at least cullRadius
+// wide. A cell pairs with itself and with a half shell of neighbors, the
+// cells east, north-west, north and north-east of it. Cells are processed
+// in six colors by (x mod 3, y mod 2). A cell writes to no cell more than
+// one column or row away, so the cells of one color run in parallel
+// without conflicts. The order in which each particle sums its forces is
+// then fixed by the grid alone, which makes the result independent of the
+// number of threads and ranks. It differs from simulateStep in rounding.
+class PairForces
+{
+public:
+    // Steps particles with the forces of all pairs within cullRadius in
+    // grid, which holds the particles and at least every particle within
+    // cullRadius of them. Particle ids are below numIds. If interactions
+    // is not null, interactions[i] receives the number of pairs evaluated
+    // for particles[i].
+    void simulateStep(const UniformGrid& grid,
+                      const std::vector<Particle>& particles,
+                      std::vector<Particle>& newParticles,
+                      StepParameters params, size_t numIds, ThreadPool* pool,
+                      uint32_t* interactions = nullptr);
+
+    // pair evaluations of the last step
+    uint64_t pairsEvaluated = 0;
+
+private:
+    // per grid particle: force sum and pairs evaluated
+    std::vector<float> forceX, forceY;
+    std::vector<uint32_t> pairCount;
+    // whether a cell holds one of the stepped particles, whose forces are
+    // needed; pairs of two other cells are skipped
+    std::vector<uint8_t> cellNeeded;
+    std::vector<int> gridIndexOfId;
+    std::vector<uint32_t> colorCells;
+};
+
+#endif
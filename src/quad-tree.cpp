@@ -1,52 +1,55 @@
 #include "quad-tree.h"
+#include "thread-pool.h"
 #include <algorithm>
 #include <iostream>
 #include <tuple>
 
-// NOTE: You do not need to modify this function but you are welcome to optomize it if you wish.
-// Do not change the function defintions.
+// The queries append, without clearing, the particles strictly closer than
+// radius, in tree order. The force loops sum in that order and the kernel
+// of force-kernel.h repeats the strict test, so results stay bit identical
+// across the query paths only while both hold.
 
-void getParticlesImpl(std::vector<Particle>& particles, QuadTreeNode * node, Vec2 bmin, Vec2 bmax, Vec2 position, float radius)
-{
-    if (node->isLeaf)
-    {
-        for (auto & p : node->particles)
-            if ((position - p.position).length() < radius)
-                particles.push_back(p);
-        return;
-    }
-    Vec2 pivot = (bmin + bmax) * 0.5f;
-    Vec2 size = (bmax - bmin) * 0.5f;
-    int containingChild = (position.x < pivot.x ? 0 : 1) + ((position.y < pivot.y ? 1 : 0) << 1);
-    for (int i = 0; i < 4; i++)
-    {
-        Vec2 childBMin;
-        childBMin.x = (i & 1) ? pivot.x : bmin.x;
-        childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
-        Vec2 childBMax = childBMin + size;
-        if (boxPointDistance(childBMin, childBMax, position) <= radius)
-            getParticlesImpl(particles, node->children[i].get(), childBMin, childBMax, position, radius);
-    }
+void QuadTree::getParticles(std::vector<Particle>& particles, Vec2 position,
+                            float radius) const {
+    forEachParticle(position, radius,
+                    [&](const Particle& p) { particles.push_back(p); });
 }
 
-// NOTE: Do not modify any of this functions.
-
-void QuadTree::getParticles(std::vector<Particle>& particles, Vec2 position,
+void QuadTree::getParticles(ParticleSoA& particles, Vec2 position,
                             float radius) const {
-    getParticlesImpl(particles, root.get(), bmin, bmax, position, radius);
+    forEachParticle(position, radius,
+                    [&](const Particle& p) { particles.push_back(p); });
 }
 
-bool checkNode(std::shared_ptr<QuadTreeNode> node,
+void QuadTree::getParticleIndices(std::vector<uint32_t>& indices,
+                                  Vec2 position, float radius) const {
+    indices.clear();
+    forEachLeafRange(position, radius, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+            if ((position - particles[i].position).length() < radius)
+                indices.push_back(i);
+    });
+}
+
+bool checkNode(const QuadTree& tree, uint32_t nodeIndex,
                const Vec2& bmin, const Vec2& bmax)
 {
-  if (!node) {
+  if (nodeIndex >= tree.nodes.size()) {
     std::cout << "a null node" << std::endl;
     return false;
   }
 
+  const QuadTreeNode& node = tree.nodes[nodeIndex];
   const float delta = 1e-4f;
-  if (node->isLeaf) {
-    for (auto p : node->particles) {
+  if (node.isLeaf) {
+    if (node.particleBegin > node.particleEnd ||
+        node.particleEnd > tree.particles.size()) {
+      std::cout << "leaf particle range [" << node.particleBegin << ", "
+                << node.particleEnd << ") out of bounds" << std::endl;
+      return false;
+    }
+    for (uint32_t i = node.particleBegin; i < node.particleEnd; i++) {
+      const Particle& p = tree.particles[i];
       if (p.position.x > bmax.x + delta || p.position.y > bmax.y + delta ||
           p.position.x < bmin.x - delta || p.position.y < bmin.y - delta) {
         std::cout << "particle: " << p.id
@@ -65,7 +68,7 @@ bool checkNode(std::shared_ptr<QuadTreeNode> node,
       Vec2 childBMin;
       childBMin.x = (i & 1) ? pivot.x : bmin.x;
       childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
-      if (!checkNode(node->children[i], childBMin, childBMin + size)) {
+      if (!checkNode(tree, node.firstChild + i, childBMin, childBMin + size)) {
         return false;
       }
     }
@@ -75,10 +78,64 @@ bool checkNode(std::shared_ptr<QuadTreeNode> node,
 
 bool QuadTree::checkTree()
 {
-  return checkNode(root, bmin, bmax);
+  if (nodes.empty()) {
+    std::cout << "a null node" << std::endl;
+    return false;
+  }
+  return checkNode(*this, 0, bmin, bmax);
+}
+
+void countLeavesOf(const QuadTree& tree, uint32_t nodeIndex)
+{
+  const QuadTreeNode& node = tree.nodes[nodeIndex];
+  if (node.isLeaf) {
+    COUNT(leaves, 1);
+    COUNT_BIN(leafOccupancy, leafOccupancyBin(node.particleEnd - node.particleBegin));
+    return;
+  }
+  for (int i = 0; i < 4; i++)
+    countLeavesOf(tree, node.firstChild + i);
 }
 
-void showNode(std::shared_ptr<QuadTreeNode> node,
+void QuadTree::countLeaves() const
+{
+  if (CountersEnabled && !nodes.empty())
+    countLeavesOf(*this, 0);
+}
+
+NodeMoments computeMomentsOf(QuadTree& tree, uint32_t nodeIndex)
+{
+  const QuadTreeNode& node = tree.nodes[nodeIndex];
+  float mass = 0.0f;
+  Vec2 weighted = Vec2(0.0f, 0.0f);
+  if (node.isLeaf) {
+    for (uint32_t i = node.particleBegin; i < node.particleEnd; i++) {
+      const Particle& p = tree.particles[i];
+      mass += p.mass;
+      weighted += p.position * p.mass;
+    }
+  } else {
+    for (int i = 0; i < 4; i++) {
+      NodeMoments child = computeMomentsOf(tree, node.firstChild + i);
+      mass += child.mass;
+      weighted += child.center * child.mass;
+    }
+  }
+  NodeMoments moments;
+  moments.mass = mass;
+  moments.center = mass > 0.0f ? weighted * (1.0f / mass) : Vec2(0.0f, 0.0f);
+  tree.moments[nodeIndex] = moments;
+  return moments;
+}
+
+void QuadTree::computeMoments()
+{
+  moments.resize(nodes.size());
+  if (!nodes.empty())
+    computeMomentsOf(*this, 0);
+}
+
+void showNode(const QuadTree& tree, uint32_t nodeIndex,
               Image& image, float viewportRadius,
               const Vec2& bmin, const Vec2& bmax)
 {
@@ -90,14 +147,15 @@ void showNode(std::shared_ptr<QuadTreeNode> node,
   boxMax.y = (int)((bmax.y + viewportRadius) * invViewportSize * image.height);
   image.drawRectangle(boxMin, boxMax);
   // draw children
-  if (!node->isLeaf) {
+  const QuadTreeNode& node = tree.nodes[nodeIndex];
+  if (!node.isLeaf) {
     Vec2 pivot = (bmin + bmax) * 0.5f;
     Vec2 size = (bmax - bmin) * 0.5f;
     for (int i = 0; i < 4; i++) {
       Vec2 childBMin;
       childBMin.x = (i & 1) ? pivot.x : bmin.x;
       childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
-      showNode(node->children[i], image, viewportRadius,
+      showNode(tree, node.firstChild + i, image, viewportRadius,
                childBMin, childBMin + size);
     }
   }
@@ -106,57 +164,624 @@ void showNode(std::shared_ptr<QuadTreeNode> node,
 
 void QuadTree::showStructure(Image& image, float viewportRadius)
 {
-  showNode(root, image, viewportRadius, bmin, bmax);
+  if (!nodes.empty())
+    showNode(*this, 0, image, viewportRadius, bmin, bmax);
 }
 
-const int QuadTreeLeafSize = 8;
+inline int childIndex(const Vec2& position, const Vec2& pivot)
+{
+  int xDir = (position.x < pivot.x) ? 0 : 1;
+  int yDir = (position.y < pivot.y) ? 0 : 1;
+  return xDir + (yDir << 1);
+}
 
-std::shared_ptr<QuadTreeNode> buildQuadTreeImpl(
-    const std::vector<Particle> & particles, Vec2 bmin, Vec2 bmax)
+struct DeferredSubtree
 {
-  std::shared_ptr<QuadTreeNode> result = std::make_shared<QuadTreeNode>();
-  if (particles.size() <= QuadTreeLeafSize) {
-    result->isLeaf = true;
-    result->particles = particles;
-  } else {
-    result->isLeaf = false;
-    Vec2 pivot = (bmin + bmax) * 0.5f;
-    Vec2 size = (bmax - bmin) * 0.5f;
-    std::vector<Particle> subTreeParticles[4];
-    for (auto p : particles) {
-      int xDir = (p.position.x < pivot.x) ? 0 : 1;
-      int yDir = (p.position.y < pivot.y) ? 0 : 1;
-      subTreeParticles[xDir + (yDir << 1)].push_back(p);
+  uint32_t node, begin, end;
+  Vec2 bmin, bmax;
+  int level;
+};
+
+// Builds the subtree rooted at nodes[nodeIndex] over
+// quadTree.particles[begin, end), at depth level of the whole tree.
+// The range is partitioned in place into the four quadrants; the partition is
+// stable so particles keep the order of sortMortonKeys within each leaf.
+// Nodes at stopLevel that are still above the leaf size are not split but
+// appended to deferred, so their subtrees can be built in parallel.
+template <int LeafSize>
+void buildQuadTreeImpl(QuadTree& quadTree, std::vector<QuadTreeNode>& nodes,
+                       uint32_t nodeIndex, uint32_t begin, uint32_t end,
+                       Vec2 bmin, Vec2 bmax, int level = 0, int stopLevel = -1,
+                       std::vector<DeferredSubtree>* deferred = nullptr)
+{
+  QuadTreeNode& node = nodes[nodeIndex];
+  node.particleBegin = begin;
+  node.particleEnd = end;
+  if (end - begin <= LeafSize) {
+    node.isLeaf = true;
+    return;
+  }
+  if (level == stopLevel) {
+    DeferredSubtree subtree = { nodeIndex, begin, end, bmin, bmax, level };
+    deferred->push_back(subtree);
+    return;
+  }
+
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  Particle* particles = quadTree.particles.data();
+  Particle* scratch = quadTree.scratch.data();
+
+  uint32_t childBegin[5] = {0, 0, 0, 0, 0};
+  for (uint32_t i = begin; i < end; i++)
+    childBegin[childIndex(particles[i].position, pivot) + 1]++;
+  childBegin[0] = begin;
+  for (int i = 0; i < 4; i++)
+    childBegin[i + 1] += childBegin[i];
+
+  uint32_t offset[4] = {childBegin[0], childBegin[1], childBegin[2], childBegin[3]};
+  for (uint32_t i = begin; i < end; i++)
+    scratch[offset[childIndex(particles[i].position, pivot)]++] = particles[i];
+  std::copy(scratch + begin, scratch + end, particles + begin);
+
+  uint32_t firstChild = (uint32_t)nodes.size();
+  nodes.resize(firstChild + 4);
+  nodes[nodeIndex].isLeaf = false;
+  nodes[nodeIndex].firstChild = firstChild;
+  for (int i = 0; i < 4; ++i) {
+    Vec2 childBMin;
+    childBMin.x = (i & 1) ? pivot.x : bmin.x;
+    childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
+    buildQuadTreeImpl<LeafSize>(quadTree, nodes, firstChild + i, childBegin[i],
+                                childBegin[i + 1], childBMin, childBMin + size,
+                                level + 1, stopLevel, deferred);
+  }
+}
+
+// Number of quadtree levels encoded in a Morton key, two bits per level.
+const int MaxMortonLevels = 16;
+
+// The subdivision along x only depends on the x decisions taken above a
+// node, and likewise for y, so each axis has a one dimensional tree of split
+// positions. This writes the splits of the first `levels` levels of that
+// tree in order, computed with exactly the float arithmetic of
+// buildQuadTreeImpl, so splits[k - 1] <= x < splits[k] for the cell k whose
+// binary code is the path of x decisions.
+void buildSplitTable(float*& splits, float lo, float hi, int levels)
+{
+  float pivot = (lo + hi) * 0.5f;
+  float size = (hi - lo) * 0.5f;
+  if (levels > 1)
+    buildSplitTable(splits, lo, lo + size, levels - 1);
+  *splits++ = pivot;
+  if (levels > 1)
+    buildSplitTable(splits, pivot, pivot + size, levels - 1);
+}
+
+void AxisCells::build(float bmin, float bmax, int levels)
+{
+  // the tables only depend on the bounds, which incremental updates and
+  // the slabs of a distributed run keep for many builds
+  if (levels == builtLevels && bmin == lo && bmax == hi)
+    return;
+  builtLevels = levels;
+  cells = 1u << levels;
+  splits.resize(cells - 1);
+  float* end = splits.data();
+  buildSplitTable(end, bmin, bmax, levels);
+  lo = bmin;
+  hi = bmax;
+  float extent = bmax - bmin;
+  scale = extent > 0.0f ? cells / extent : 0.0f;
+  sorted = std::is_sorted(splits.begin(), splits.end());
+}
+
+// spreads the low 16 bits of v to the even bits of the result
+inline uint32_t spreadBits(uint32_t v)
+{
+  v &= 0x0000ffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+// Each pair of key bits is the child index the recursive builder picks at
+// that level, top level first.
+inline uint32_t mortonKey(Vec2 position, const AxisCells& cellsX,
+                          const AxisCells& cellsY)
+{
+  return spreadBits(cellsX.find(position.x)) |
+         (spreadBits(cellsY.find(position.y)) << 1);
+}
+
+// Stable LSD radix sort of (key, index) pairs, 8 bits per pass.
+void radixSortKeys(std::vector<uint32_t>& keys, std::vector<uint32_t>& order,
+                   std::vector<uint32_t>& keysScratch,
+                   std::vector<uint32_t>& orderScratch, int keyBits)
+{
+  const size_t n = keys.size();
+  keysScratch.resize(n);
+  orderScratch.resize(n);
+  for (int shift = 0; shift < keyBits; shift += 8) {
+    uint32_t offset[256] = {0};
+    for (size_t i = 0; i < n; i++)
+      offset[(keys[i] >> shift) & 0xff]++;
+    uint32_t sum = 0;
+    for (int d = 0; d < 256; d++) {
+      uint32_t count = offset[d];
+      offset[d] = sum;
+      sum += count;
     }
-    for (int i = 0; i < 4; ++i) {
-      Vec2 childBMin;
-      childBMin.x = (i & 1) ? pivot.x : bmin.x;
-      childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
-      result->children[i] = buildQuadTreeImpl(subTreeParticles[i], childBMin,
-                                              childBMin + size);
+    for (size_t i = 0; i < n; i++) {
+      uint32_t dst = offset[(keys[i] >> shift) & 0xff]++;
+      keysScratch[dst] = keys[i];
+      orderScratch[dst] = order[i];
     }
+    keys.swap(keysScratch);
+    order.swap(orderScratch);
   }
-  return result;
 }
 
+// branch free binary search for the first key >= value in keys[begin, end)
+inline uint32_t lowerBound(const uint32_t* keys, uint32_t begin, uint32_t end,
+                           uint32_t value)
+{
+  if (begin == end)
+    return begin;
+  const uint32_t* base = keys + begin;
+  uint32_t length = end - begin;
+  while (length > 1) {
+    uint32_t half = length / 2;
+    base = (base[half] < value) ? base + half : base;
+    length -= half;
+  }
+  return (uint32_t)(base - keys) + (*base < value ? 1 : 0);
+}
+
+// Emits the node for the sorted key range [begin, end) whose keys share
+// their first `level` digits. Children are found by binary search on the
+// next digit, so no particle data moves while the tree is built. Ranges
+// that are still too large once the key digits run out, or at stopLevel,
+// are deferred; the former are finished by buildQuadTreeImpl.
+template <int LeafSize>
+void buildMortonTreeImpl(QuadTree& quadTree, std::vector<QuadTreeNode>& nodes,
+                         uint32_t nodeIndex, uint32_t begin, uint32_t end,
+                         Vec2 bmin, Vec2 bmax, int level, int stopLevel,
+                         std::vector<DeferredSubtree>& deferred)
+{
+  if (end - begin <= LeafSize || level == MaxMortonLevels ||
+      level == stopLevel) {
+    if (end - begin > LeafSize) {
+      DeferredSubtree subtree = { nodeIndex, begin, end, bmin, bmax, level };
+      deferred.push_back(subtree);
+      return;
+    }
+    QuadTreeNode& node = nodes[nodeIndex];
+    node.isLeaf = true;
+    node.particleBegin = begin;
+    node.particleEnd = end;
+    return;
+  }
+  nodes[nodeIndex].particleBegin = begin;
+  nodes[nodeIndex].particleEnd = end;
+
+  // all keys in the range share the digits above this level
+  const uint32_t* keys = quadTree.mortonKeys.data();
+  const int shift = 2 * (MaxMortonLevels - 1 - level);
+  const uint32_t prefix = keys[begin] & ~((4u << shift) - 1);
+  uint32_t childBegin[5];
+  childBegin[0] = begin;
+  childBegin[4] = end;
+  for (int i = 1; i < 4; i++)
+    childBegin[i] = lowerBound(keys, childBegin[i - 1], end,
+                               prefix | ((uint32_t)i << shift));
+
+  Vec2 pivot = (bmin + bmax) * 0.5f;
+  Vec2 size = (bmax - bmin) * 0.5f;
+  uint32_t firstChild = (uint32_t)nodes.size();
+  nodes.resize(firstChild + 4);
+  nodes[nodeIndex].isLeaf = false;
+  nodes[nodeIndex].firstChild = firstChild;
+  for (int i = 0; i < 4; ++i) {
+    Vec2 childBMin;
+    childBMin.x = (i & 1) ? pivot.x : bmin.x;
+    childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
+    buildMortonTreeImpl<LeafSize>(quadTree, nodes, firstChild + i,
+                                  childBegin[i], childBegin[i + 1], childBMin,
+                                  childBMin + size, level + 1, stopLevel,
+                                  deferred);
+  }
+}
+
+// Computes the Morton key at MaxMortonLevels of every particle into
+// quadTree.mortonKeys, with quadTree.mortonOrder the identity.
+void computeMortonKeys(const std::vector<Particle>& particles,
+                       QuadTree& quadTree, ThreadPool* pool)
+{
+  const uint32_t n = (uint32_t)particles.size();
+  const AxisCells& cellsX = quadTree.mortonCellsX;
+  const AxisCells& cellsY = quadTree.mortonCellsY;
+  quadTree.mortonCellsX.build(quadTree.bmin.x, quadTree.bmax.x, MaxMortonLevels);
+  quadTree.mortonCellsY.build(quadTree.bmin.y, quadTree.bmax.y, MaxMortonLevels);
+
+  quadTree.mortonKeys.resize(n);
+  quadTree.mortonOrder.resize(n);
+  parallelFor(pool, n, [&](uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      quadTree.mortonKeys[i] = mortonKey(particles[i].position, cellsX, cellsY);
+      quadTree.mortonOrder[i] = i;
+    }
+  });
+}
+
+// Sorts the pairs of quadTree.mortonKeys and the particle indices in
+// quadTree.mortonOrder by key, ties by id, and copies the particles into
+// quadTree.particles in that order. Every node of the tree is a cell of
+// some level and so a run of this order: the particles are already grouped
+// by leaf for either builder, and within a leaf they are ordered by
+// position rather than input order. The order in which any subset of
+// particles is visited then depends only on the bounds, not on which other
+// particles are in the tree, so a rank holding part of the particles sums
+// forces in the same order as a single process.
+void sortMortonKeys(const std::vector<Particle>& particles, QuadTree& quadTree,
+                    ThreadPool* pool)
+{
+  const uint32_t n = (uint32_t)particles.size();
+  radixSortKeys(quadTree.mortonKeys, quadTree.mortonOrder,
+                quadTree.mortonKeysScratch, quadTree.mortonOrderScratch,
+                2 * MaxMortonLevels);
+
+  const uint32_t* keys = quadTree.mortonKeys.data();
+  uint32_t* order = quadTree.mortonOrder.data();
+  for (uint32_t begin = 0, end; begin < n; begin = end) {
+    end = begin + 1;
+    while (end < n && keys[end] == keys[begin])
+      end++;
+    if (end - begin > 1)
+      std::sort(order + begin, order + end, [&](uint32_t a, uint32_t b) {
+        return particles[a].id < particles[b].id;
+      });
+  }
+
+  quadTree.particles.resize(n);
+  parallelFor(pool, n, [&](uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; i++)
+      quadTree.particles[i] = particles[order[i]];
+  });
+}
+
+// Builds the subtree of a deferred node into nodes, which start out with
+// just the subtree root at index 0.
+template <int LeafSize>
+void buildSubtree(QuadTree& quadTree, TreeBuilderType builder,
+                  const DeferredSubtree& subtree,
+                  std::vector<QuadTreeNode>& nodes)
+{
+  nodes.clear();
+  nodes.resize(1);
+  if (builder == TreeBuilderType::Morton && subtree.level < MaxMortonLevels) {
+    std::vector<DeferredSubtree> deferred;
+    buildMortonTreeImpl<LeafSize>(quadTree, nodes, 0, subtree.begin, subtree.end,
+                                  subtree.bmin, subtree.bmax, subtree.level, -1,
+                                  deferred);
+    for (auto& d : deferred)
+      buildQuadTreeImpl<LeafSize>(quadTree, nodes, d.node, d.begin, d.end,
+                                  d.bmin, d.bmax, d.level);
+  } else {
+    buildQuadTreeImpl<LeafSize>(quadTree, nodes, 0, subtree.begin, subtree.end,
+                                subtree.bmin, subtree.bmax, subtree.level);
+  }
+}
+
+// Replaces nodes[root] by the subtree built by buildSubtree, appending its
+// other nodes to the pool.
+void spliceSubtree(std::vector<QuadTreeNode>& nodes, uint32_t root,
+                   const std::vector<QuadTreeNode>& subtreeNodes)
+{
+  // subtree node k > 0 lands at offset + k
+  const uint32_t offset = (uint32_t)nodes.size() - 1;
+  nodes[root] = subtreeNodes[0];
+  if (!nodes[root].isLeaf)
+    nodes[root].firstChild += offset;
+  for (size_t k = 1; k < subtreeNodes.size(); k++) {
+    nodes.push_back(subtreeNodes[k]);
+    if (!nodes.back().isLeaf)
+      nodes.back().firstChild += offset;
+  }
+}
+
+void fillParticlesSoA(QuadTree& quadTree, ThreadPool* pool)
+{
+  quadTree.particlesSoA.resize(quadTree.particles.size());
+  parallelFor(pool, (uint32_t)quadTree.particles.size(),
+              [&](uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; i++)
+      quadTree.particlesSoA.set(i, quadTree.particles[i]);
+  });
+}
 
 bool buildQuadTree(const std::vector<Particle>& particles, QuadTree& quadTree)
+{
+  return buildQuadTree(particles, quadTree, TreeBuilderType::Recursive);
+}
+
+bool buildQuadTree(const std::vector<Particle>& particles, QuadTree& quadTree,
+                   TreeBuilderType builder)
 {
   // find bounds
-  Vec2 bmin(1e30f, 1e30f);
-  Vec2 bmax(-1e30f, -1e30f);
+  Vec2 bmin, bmax;
+  computeBounds(particles, bmin, bmax);
+  return buildQuadTree(particles, quadTree, builder, bmin, bmax);
+}
 
-  for (auto &p : particles){
-    bmin.x = fminf(bmin.x, p.position.x);
-    bmin.y = fminf(bmin.y, p.position.y);
-    bmax.x = fmaxf(bmax.x, p.position.x);
-    bmax.y = fmaxf(bmax.y, p.position.y);
+// Builds the nodes over the sorted quadTree.particles.
+template <int LeafSize>
+void buildNodes(QuadTree& quadTree, TreeBuilderType builder, ThreadPool* pool)
+{
+  const uint32_t n = (uint32_t)quadTree.particles.size();
+  const Vec2 bmin = quadTree.bmin, bmax = quadTree.bmax;
+  DeferredSubtree root = { 0, 0, n, bmin, bmax, 0 };
+  if (!pool || pool->numThreads() == 1) {
+    buildSubtree<LeafSize>(quadTree, builder, root, quadTree.nodes);
+  } else {
+    // the top levels are built serially and stop once there are a few
+    // subtrees per thread; the subtrees are then built in parallel, each
+    // into its own node array, and spliced into the pool in order
+    int stopLevel = 1;
+    while ((1 << (2 * stopLevel)) < 8 * pool->numThreads())
+      stopLevel++;
+    std::vector<DeferredSubtree> frontier;
+    quadTree.nodes.clear();
+    quadTree.nodes.resize(1);
+    if (builder == TreeBuilderType::Morton)
+      buildMortonTreeImpl<LeafSize>(quadTree, quadTree.nodes, 0, 0, n, bmin, bmax,
+                                    0, stopLevel, frontier);
+    else
+      buildQuadTreeImpl<LeafSize>(quadTree, quadTree.nodes, 0, 0, n, bmin, bmax,
+                                  0, stopLevel, &frontier);
+
+    if (quadTree.subtreeNodes.size() < frontier.size())
+      quadTree.subtreeNodes.resize(frontier.size());
+    pool->parallelFor((uint32_t)frontier.size(), 1,
+                      [&](uint32_t begin, uint32_t end) {
+      for (uint32_t i = begin; i < end; i++)
+        buildSubtree<LeafSize>(quadTree, builder, frontier[i],
+                               quadTree.subtreeNodes[i]);
+    });
+    for (size_t i = 0; i < frontier.size(); i++)
+      spliceSubtree(quadTree.nodes, frontier[i].node, quadTree.subtreeNodes[i]);
   }
+}
 
+// Builds the nodes from the keys left in quadTree.mortonKeys and
+// quadTree.mortonOrder by computeMortonKeys, in any order.
+bool buildFromMortonKeys(const std::vector<Particle>& particles,
+                         QuadTree& quadTree, TreeBuilderType builder,
+                         ThreadPool* pool)
+{
+  const uint32_t n = (uint32_t)particles.size();
+  sortMortonKeys(particles, quadTree, pool);
+  quadTree.scratch.resize(n);
+  switch (quadTree.leafSize) {
+  case 4: buildNodes<4>(quadTree, builder, pool); break;
+  case 16: buildNodes<16>(quadTree, builder, pool); break;
+  case 32: buildNodes<32>(quadTree, builder, pool); break;
+  case 64: buildNodes<64>(quadTree, builder, pool); break;
+  default: buildNodes<8>(quadTree, builder, pool); break;
+  }
+
+  quadTree.freeChildBlocks.clear();
+  fillParticlesSoA(quadTree, pool);
+  quadTree.updated = false;
+  quadTree.movedParticles = n;
+  return quadTree.checkTree();
+}
+
+bool buildQuadTree(const std::vector<Particle>& particles, QuadTree& quadTree,
+                   TreeBuilderType builder, Vec2 bmin, Vec2 bmax,
+                   ThreadPool* pool)
+{
   // build nodes
   quadTree.bmin = bmin;
   quadTree.bmax = bmax;
+  computeMortonKeys(particles, quadTree, pool);
+  return buildFromMortonKeys(particles, quadTree, builder, pool);
+}
 
-  quadTree.root = buildQuadTreeImpl(particles, bmin, bmax);
+// Walks the leaves of the tree built for the previous positions and splits
+// the slots into the particles whose new key is still inside their leaf's
+// cell and the ones that left it. Keys are indexed by slot. Stayers are
+// appended in tree order, each leaf's sorted with less, so they end up
+// sorted as a whole. Returns false for trees deeper than the key levels.
+template <typename Less>
+bool collectStayers(const QuadTree& quadTree, uint32_t nodeIndex, int level,
+                    uint32_t prefix, const uint32_t* keys, Less& less,
+                    std::vector<uint32_t>& stayers,
+                    std::vector<uint32_t>& movers)
+{
+  const QuadTreeNode& node = quadTree.nodes[nodeIndex];
+  if (!node.isLeaf) {
+    if (level == MaxMortonLevels)
+      return false;
+    const int shift = 2 * (MaxMortonLevels - 1 - level);
+    for (int i = 0; i < 4; i++)
+      if (!collectStayers(quadTree, node.firstChild + i, level + 1,
+                          prefix | ((uint32_t)i << shift), keys, less,
+                          stayers, movers))
+        return false;
+    return true;
+  }
+  // a cell at level is the keys sharing its first 2 * level bits
+  const int cellShift = 2 * (MaxMortonLevels - level);
+  size_t leafBegin = stayers.size();
+  for (uint32_t slot = node.particleBegin; slot < node.particleEnd; slot++) {
+    bool stays = level == 0 ||
+                 (keys[slot] >> cellShift) == (prefix >> cellShift);
+    (stays ? stayers : movers).push_back(slot);
+  }
+  std::sort(stayers.begin() + leafBegin, stayers.end(), less);
+  return true;
+}
+
+void freeSubtree(QuadTree& quadTree, uint32_t nodeIndex)
+{
+  if (quadTree.nodes[nodeIndex].isLeaf)
+    return;
+  uint32_t firstChild = quadTree.nodes[nodeIndex].firstChild;
+  for (int i = 0; i < 4; i++)
+    freeSubtree(quadTree, firstChild + i);
+  quadTree.freeChildBlocks.push_back(firstChild);
+}
+
+// Fits the existing node at nodeIndex to the sorted key range [begin, end):
+// internal nodes that dropped to the leaf size are merged into a leaf and
+// leaves above it are split, reusing freed child blocks. Untouched parts of
+// the tree keep their nodes. Returns false if a cell at the last key level
+// holds more than the leaf size, which only a full build can split.
+template <int LeafSize>
+bool refitNode(QuadTree& quadTree, uint32_t nodeIndex, uint32_t begin,
+               uint32_t end, int level)
+{
+  if (end - begin <= LeafSize) {
+    freeSubtree(quadTree, nodeIndex);
+    QuadTreeNode& node = quadTree.nodes[nodeIndex];
+    node.isLeaf = true;
+    node.particleBegin = begin;
+    node.particleEnd = end;
+    return true;
+  }
+  if (level == MaxMortonLevels)
+    return false;
+
+  if (quadTree.nodes[nodeIndex].isLeaf) {
+    uint32_t firstChild;
+    if (!quadTree.freeChildBlocks.empty()) {
+      firstChild = quadTree.freeChildBlocks.back();
+      quadTree.freeChildBlocks.pop_back();
+    } else {
+      firstChild = (uint32_t)quadTree.nodes.size();
+      quadTree.nodes.resize(firstChild + 4);
+    }
+    for (int i = 0; i < 4; i++)
+      quadTree.nodes[firstChild + i].isLeaf = true;
+    quadTree.nodes[nodeIndex].isLeaf = false;
+    quadTree.nodes[nodeIndex].firstChild = firstChild;
+  }
+  quadTree.nodes[nodeIndex].particleBegin = begin;
+  quadTree.nodes[nodeIndex].particleEnd = end;
+
+  const uint32_t* keys = quadTree.mortonKeys.data();
+  const int shift = 2 * (MaxMortonLevels - 1 - level);
+  const uint32_t prefix = keys[begin] & ~((4u << shift) - 1);
+  uint32_t childBegin[5];
+  childBegin[0] = begin;
+  childBegin[4] = end;
+  for (int i = 1; i < 4; i++)
+    childBegin[i] = lowerBound(keys, childBegin[i - 1], end,
+                               prefix | ((uint32_t)i << shift));
+  uint32_t firstChild = quadTree.nodes[nodeIndex].firstChild;
+  for (int i = 0; i < 4; i++)
+    if (!refitNode<LeafSize>(quadTree, firstChild + i, childBegin[i],
+                             childBegin[i + 1], level + 1))
+      return false;
+  return true;
+}
+
+// An update that moves more than 1 / MaxMovedFraction of the particles
+// gives way to a full build.
+const uint32_t MaxMovedFraction = 4;
+
+// Updates the tree in place for the new positions of the particles it was
+// built from, or falls back to a full build from the new keys.
+bool updateQuadTreeImpl(const std::vector<Particle>& particles,
+                        QuadTree& quadTree, TreeBuilderType builder,
+                        ThreadPool* pool)
+{
+  const uint32_t n = (uint32_t)particles.size();
+  const AxisCells& cellsX = quadTree.mortonCellsX;
+  const AxisCells& cellsY = quadTree.mortonCellsY;
+
+  // new key of every slot, particle order[slot] sits in slot
+  std::vector<uint32_t>& order = quadTree.mortonOrder;
+  std::vector<uint32_t>& slotKeys = quadTree.mortonKeysScratch;
+  slotKeys.resize(n);
+  parallelFor(pool, n, [&](uint32_t begin, uint32_t end) {
+    for (uint32_t slot = begin; slot < end; slot++)
+      slotKeys[slot] = mortonKey(particles[order[slot]].position, cellsX, cellsY);
+  });
+
+  // keys and ids decide the order just like in sortMortonKeys
+  auto slotLess = [&](uint32_t a, uint32_t b) {
+    if (slotKeys[a] != slotKeys[b])
+      return slotKeys[a] < slotKeys[b];
+    return particles[order[a]].id < particles[order[b]].id;
+  };
+  std::vector<uint32_t>& stayers = quadTree.mortonOrderScratch;
+  std::vector<uint32_t>& movers = quadTree.movers;
+  stayers.clear();
+  movers.clear();
+  // sorting many movers costs more than the radix sort of a full build,
+  // which can start from the keys computed here
+  if (!collectStayers(quadTree, 0, 0, 0, slotKeys.data(), slotLess,
+                      stayers, movers) ||
+      movers.size() > n / MaxMovedFraction) {
+    quadTree.mortonKeys.swap(slotKeys);
+    return buildFromMortonKeys(particles, quadTree, builder, pool);
+  }
+  std::sort(movers.begin(), movers.end(), slotLess);
+
+  // the new slot order, and from it the new keys and particle order
+  std::vector<uint32_t>& newSlots = quadTree.mergedSlots;
+  newSlots.resize(n);
+  std::merge(stayers.begin(), stayers.end(), movers.begin(), movers.end(),
+             newSlots.begin(), slotLess);
+  std::vector<uint32_t>& newOrder = stayers;
+  newOrder.resize(n);
+  quadTree.mortonKeys.resize(n);
+  for (uint32_t i = 0; i < n; i++) {
+    quadTree.mortonKeys[i] = slotKeys[newSlots[i]];
+    newOrder[i] = order[newSlots[i]];
+  }
+  order.swap(newOrder);
+  parallelFor(pool, n, [&](uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; i++)
+      quadTree.particles[i] = particles[order[i]];
+  });
+
+  bool refitted;
+  switch (quadTree.leafSize) {
+  case 4: refitted = refitNode<4>(quadTree, 0, 0, n, 0); break;
+  case 16: refitted = refitNode<16>(quadTree, 0, 0, n, 0); break;
+  case 32: refitted = refitNode<32>(quadTree, 0, 0, n, 0); break;
+  case 64: refitted = refitNode<64>(quadTree, 0, 0, n, 0); break;
+  default: refitted = refitNode<8>(quadTree, 0, 0, n, 0); break;
+  }
+  if (!refitted)
+    return buildFromMortonKeys(particles, quadTree, builder, pool);
+  fillParticlesSoA(quadTree, pool);
+  quadTree.updated = true;
+  quadTree.movedParticles = (uint32_t)movers.size();
   return quadTree.checkTree();
 }
+
+bool updateQuadTree(const std::vector<Particle>& particles, QuadTree& quadTree,
+                    TreeBuilderType builder, Vec2 bmin, Vec2 bmax,
+                    ThreadPool* pool)
+{
+  const uint32_t n = (uint32_t)particles.size();
+  bool sameParticles = !quadTree.nodes.empty() &&
+                       quadTree.particles.size() == n &&
+                       quadTree.mortonOrder.size() == n &&
+                       quadTree.bmin.x == bmin.x && quadTree.bmin.y == bmin.y &&
+                       quadTree.bmax.x == bmax.x && quadTree.bmax.y == bmax.y;
+  for (uint32_t i = 0; sameParticles && i < n; i++)
+    sameParticles = quadTree.mortonOrder[i] < n &&
+                    particles[quadTree.mortonOrder[i]].id == quadTree.particles[i].id;
+  if (!sameParticles)
+    return buildQuadTree(particles, quadTree, builder, bmin, bmax, pool);
+  quadTree.mortonCellsX.build(bmin.x, bmax.x, MaxMortonLevels);
+  quadTree.mortonCellsY.build(bmin.y, bmax.y, MaxMortonLevels);
+  return updateQuadTreeImpl(particles, quadTree, builder, pool);
+}
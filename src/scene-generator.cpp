@@ -0,0 +1,163 @@
+#include "scene-generator.h"
+#include "thread-pool.h"
+
+static const char* const SceneTypeNames[] = {
+  "random", "corner", "repeat", "plummer", "clusters"
+};
+
+const char* sceneTypeName(SceneType type)
+{
+  return SceneTypeNames[(int)type];
+}
+
+// The random stream of one particle: splitmix64 over a counter that starts
+// at a hash of the seed and the particle id.
+class ParticleRandom
+{
+public:
+    ParticleRandom(uint64_t seed, uint64_t id)
+        : state(mix(seed * 0x9e3779b97f4a7c15ull + id)) {}
+
+    uint64_t next()
+    {
+        state += 0x9e3779b97f4a7c15ull;
+        return mix(state);
+    }
+    // uniform in [0, 1)
+    float uniform() { return (next() >> 40) * (1.0f / 16777216.0f); }
+    float uniform(float lo, float hi) { return lo + (hi - lo) * uniform(); }
+    // standard normal, by Box-Muller
+    float normal()
+    {
+        float u = 1.0f - uniform();
+        return sqrtf(-2.0f * logf(u)) * cosf(6.2831853f * uniform());
+    }
+
+    static uint64_t mix(uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+private:
+    uint64_t state;
+};
+
+static Particle randomParticle(ParticleRandom& random, float spaceSize)
+{
+  Particle p;
+  p.mass = random.uniform(1.0f, 10.0f);
+  p.position.x = random.uniform(-spaceSize, spaceSize);
+  p.position.y = random.uniform(-spaceSize, spaceSize);
+  p.velocity.x = random.uniform(-spaceSize * 0.5f, spaceSize * 0.5f);
+  p.velocity.y = random.uniform(-spaceSize * 0.5f, spaceSize * 0.5f);
+  return p;
+}
+
+// in the top right quadrant, or else in one of the other three
+static Particle cornerParticle(ParticleRandom& random, float spaceSize,
+                               bool topRight)
+{
+  Particle p = randomParticle(random, spaceSize);
+  bool right = topRight, top = topRight;
+  if (!topRight) {
+    // bottom left, bottom right or top left
+    uint32_t quadrant = random.next() % 3;
+    right = quadrant == 1;
+    top = quadrant == 2;
+  }
+  p.position.x = (p.position.x + (right ? spaceSize : -spaceSize)) * 0.5f;
+  p.position.y = (p.position.y + (top ? spaceSize : -spaceSize)) * 0.5f;
+  return p;
+}
+
+static Particle plummerParticle(ParticleRandom& random, float spaceSize)
+{
+  const float scale = spaceSize / 8.0f;
+  Particle p;
+  p.mass = random.uniform(1.0f, 10.0f);
+  // radius from the inverse of the cumulative mass, cut at spaceSize
+  float r;
+  do {
+    float m = fmaxf(random.uniform(), 1e-6f);
+    r = scale / sqrtf(powf(m, -2.0f / 3.0f) - 1.0f);
+  } while (!(r <= spaceSize));
+  float angle = random.uniform(0.0f, 6.2831853f);
+  p.position = Vec2(r * cosf(angle), r * sinf(angle));
+  // speed as a fraction q of the local escape speed, drawn by rejection
+  // from q^2 (1 - q^2)^3.5, and scaled to the speeds of the random scenes
+  float q, g;
+  do {
+    q = random.uniform();
+    g = random.uniform(0.0f, 0.1f);
+  } while (g > q * q * powf(1.0f - q * q, 3.5f));
+  float speed = q * sqrtf(2.0f) * powf(1.0f + r * r / (scale * scale), -0.25f) *
+                spaceSize * 0.5f;
+  float direction = random.uniform(0.0f, 6.2831853f);
+  p.velocity = Vec2(speed * cosf(direction), speed * sinf(direction));
+  return p;
+}
+
+struct Cluster
+{
+    Vec2 center, velocity;
+    float radius;
+};
+
+static Particle clusterParticle(ParticleRandom& random, float spaceSize,
+                                const Cluster& cluster)
+{
+  Particle p;
+  p.mass = random.uniform(1.0f, 10.0f);
+  float x = cluster.center.x + cluster.radius * random.normal();
+  float y = cluster.center.y + cluster.radius * random.normal();
+  p.position.x = fminf(fmaxf(x, -spaceSize), spaceSize);
+  p.position.y = fminf(fmaxf(y, -spaceSize), spaceSize);
+  float dispersion = spaceSize * 0.05f;
+  p.velocity.x = cluster.velocity.x + dispersion * random.normal();
+  p.velocity.y = cluster.velocity.y + dispersion * random.normal();
+  return p;
+}
+
+void generateScene(SceneType type, int numParticles, float spaceSize,
+                   uint64_t seed, std::vector<Particle>& particles,
+                   ThreadPool* pool)
+{
+  particles.resize(numParticles < 0 ? 0 : numParticles);
+  // the clusters come from a stream no particle id uses
+  std::vector<Cluster> clusters(SceneClusters);
+  ParticleRandom clusterRandom(seed, ~0ull);
+  for (auto& c : clusters) {
+    c.center.x = clusterRandom.uniform(-0.75f, 0.75f) * spaceSize;
+    c.center.y = clusterRandom.uniform(-0.75f, 0.75f) * spaceSize;
+    c.radius = clusterRandom.uniform(1.0f / 32.0f, 1.0f / 8.0f) * spaceSize;
+    c.velocity.x = clusterRandom.uniform(-0.25f, 0.25f) * spaceSize;
+    c.velocity.y = clusterRandom.uniform(-0.25f, 0.25f) * spaceSize;
+  }
+  uint32_t rightCorner = (uint32_t)(particles.size() * 2 / 3);
+
+  parallelFor(pool, (uint32_t)particles.size(), [&](uint32_t begin, uint32_t end) {
+    for (uint32_t i = begin; i < end; i++) {
+      ParticleRandom random(seed, i);
+      Particle p;
+      switch (type) {
+      case SceneType::Corner:
+        p = cornerParticle(random, spaceSize, i < rightCorner);
+        break;
+      case SceneType::Plummer:
+        p = plummerParticle(random, spaceSize);
+        break;
+      case SceneType::Clusters:
+        p = clusterParticle(random, spaceSize,
+                            clusters[random.next() % SceneClusters]);
+        break;
+      default:
+        p = randomParticle(random, spaceSize);
+        break;
+      }
+      p.id = (int)i;
+      particles[i] = p;
+    }
+  });
+}
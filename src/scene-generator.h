@@ -0,0 +1,35 @@
+#ifndef SCENE_GENERATOR_H
+#define SCENE_GENERATOR_H
+
+#include <cstdint>
+#include <vector>
+#include "common.h"
+
+class ThreadPool;
+
+// Synthetic initial conditions of the SceneType families, so scaling runs
+// need no input file.
+//
+// Random, Corner and Repeat follow the benchmark files: masses in
+// [1, 10], positions uniform in [-spaceSize, spaceSize]^2 and velocities
+// uniform in [-spaceSize / 2, spaceSize / 2]^2. Corner packs the first two
+// thirds of them into the top right quadrant and spreads the rest evenly
+// over the other three. Repeat is the same scene as Random; the benchmark runs it for
+// more iterations. Plummer is a Plummer sphere projected on the plane
+// with scale radius spaceSize / 8, and Clusters is a set of Gaussian
+// clusters, each moving as a whole.
+//
+// Every particle is drawn from a counter based generator keyed by the seed
+// and its id, so scenes are generated in parallel and do not depend on
+// the number of threads.
+
+// clusters of the Clusters scene
+const int SceneClusters = 16;
+
+const char* sceneTypeName(SceneType type);
+
+void generateScene(SceneType type, int numParticles, float spaceSize,
+                   uint64_t seed, std::vector<Particle>& particles,
+                   ThreadPool* pool = nullptr);
+
+#endif
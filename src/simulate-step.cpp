@@ -0,0 +1,82 @@
+#include "simulate-step.h"
+#include <algorithm>
+
+void accumulateForceById(const Particle& target, std::vector<Attractor>& attractors,
+                         float cullRadius, Vec2& force) {
+  // attractors beyond cullRadius add exactly zero, so dropping them before
+  // the sort leaves the sum unchanged
+  auto last = std::remove_if(attractors.begin(), attractors.end(),
+                             [&](const Attractor& a) {
+    return (Vec2(a.positionX, a.positionY) - target.position).length() > cullRadius;
+  });
+  attractors.erase(last, attractors.end());
+  std::sort(attractors.begin(), attractors.end(),
+            [](const Attractor& a, const Attractor& b) { return a.id < b.id; });
+  static thread_local std::vector<float> positionX, positionY, mass;
+  positionX.resize(attractors.size());
+  positionY.resize(attractors.size());
+  mass.resize(attractors.size());
+  for (size_t k = 0; k < attractors.size(); k++) {
+    positionX[k] = attractors[k].positionX;
+    positionY[k] = attractors[k].positionY;
+    mass[k] = attractors[k].mass;
+  }
+  accumulateForce(target, positionX.data(), positionY.data(), mass.data(),
+                  (uint32_t)mass.size(), cullRadius, force);
+}
+
+void simulateStepVerlet(const NeighborList& lists,
+                        const std::vector<Particle>& local,
+                        const std::vector<int>& localIndexOfId,
+                        const std::vector<Particle>& particles,
+                        std::vector<Particle>& newParticles,
+                        StepParameters params,
+                        ThreadPool* pool,
+                        uint32_t* interactions,
+                        bool byId) {
+  parallelFor(pool, (uint32_t)particles.size(),
+              [&](uint32_t begin, uint32_t end) {
+    TraceSpan span("force chunk");
+    // the attractors of one particle, gathered for the force kernel
+    static thread_local std::vector<float> positionX, positionY, mass;
+    static thread_local std::vector<Attractor> attractors;
+    for (uint32_t i = begin; i < end; ++i) {
+      const auto& pi = particles[i];
+      int row = lists.rowOfId[pi.id];
+      positionX.clear();
+      positionY.clear();
+      mass.clear();
+      attractors.clear();
+      for (uint32_t k = lists.rowBegin[row]; k < lists.rowBegin[row + 1]; k++) {
+        int id = lists.neighborIds[k];
+        int j = localIndexOfId[id];
+        if (j < 0 || j >= (int)local.size() || local[j].id != id)
+          continue;
+        if (byId) {
+          attractors.push_back({ id, local[j].position.x, local[j].position.y,
+                                 local[j].mass });
+          continue;
+        }
+        positionX.push_back(local[j].position.x);
+        positionY.push_back(local[j].position.y);
+        mass.push_back(local[j].mass);
+      }
+      Vec2 force = Vec2(0.0f, 0.0f);
+      if (byId)
+        accumulateForceById(pi, attractors, params.cullRadius, force);
+      else
+        accumulateForce(pi, positionX.data(), positionY.data(), mass.data(),
+                        (uint32_t)mass.size(), params.cullRadius, force);
+      COUNT(queries, 1);
+      COUNT(spans, 1);
+      COUNT(candidates, mass.size());
+      COUNT_BIN(candidatesPerQuery, candidateBin((uint32_t)mass.size()));
+      if (CountersEnabled)
+        countInteractions(pi, positionX.data(), positionY.data(),
+                          (uint32_t)mass.size(), params.cullRadius);
+      if (interactions)
+        interactions[i] = lists.rowBegin[row + 1] - lists.rowBegin[row];
+      newParticles[i] = updateParticle(pi, force, params.deltaTime);
+    }
+  }, SimulateChunkSize);
+}
@@ -0,0 +1,126 @@
+#ifndef SIMULATE_STEP_H
+#define SIMULATE_STEP_H
+
+#include <cstdint>
+#include <vector>
+#include "common.h"
+#include "counters.h"
+#include "force-kernel.h"
+#include "neighbor-list.h"
+#include "thread-pool.h"
+#include "trace.h"
+
+// Particles per chunk of the force loop. Small enough that a clustered
+// region spreads over many chunks for the pool to balance.
+const uint32_t SimulateChunkSize = 256;
+
+// SpatialIndex is QuadTree or UniformGrid. If interactions is not null,
+// interactions[i] receives the number of candidate attractors the kernel
+// evaluated for particles[i], the cost measure of the load balancer.
+// Particles are independent, so the result does not depend on the number
+// of threads in pool.
+template <typename SpatialIndex>
+void simulateStep(const SpatialIndex& index,
+                  const std::vector<Particle>& particles,
+                  std::vector<Particle>& newParticles,
+                  StepParameters params,
+                  ThreadPool* pool,
+                  uint32_t* interactions = nullptr)
+{
+    parallelFor(pool, (uint32_t)particles.size(),
+                [&](uint32_t begin, uint32_t end) {
+        TraceSpan span("force chunk");
+        for (uint32_t i = begin; i < end; ++i) {
+            const auto& pi = particles[i];
+            // whole leaves are passed to the kernel, which applies the same
+            // radius test as getParticles; pi itself contributes no force
+            Vec2 force = Vec2(0.0f, 0.0f);
+            uint32_t candidates = 0;
+            index.forEachSpan(pi.position, params.cullRadius,
+                              [&](uint32_t spanBegin, uint32_t spanEnd) {
+                accumulateForce(pi, index.particlesSoA, spanBegin, spanEnd,
+                                params.cullRadius, force);
+                candidates += spanEnd - spanBegin;
+                COUNT(spans, 1);
+                if (CountersEnabled)
+                    countInteractions(pi,
+                                      index.particlesSoA.positionX.data() + spanBegin,
+                                      index.particlesSoA.positionY.data() + spanBegin,
+                                      spanEnd - spanBegin, params.cullRadius);
+            });
+            COUNT(queries, 1);
+            COUNT(candidates, candidates);
+            COUNT_BIN(candidatesPerQuery, candidateBin(candidates));
+            if (interactions)
+                interactions[i] = candidates;
+            newParticles[i] = updateParticle(pi, force, params.deltaTime);
+        }
+    }, SimulateChunkSize);
+}
+
+// An attractor gathered for accumulateForceById.
+struct Attractor
+{
+    int id;
+    float positionX, positionY, mass;
+};
+
+// Adds the forces of the attractors on target to force, summed in id order.
+// Reorders attractors.
+void accumulateForceById(const Particle& target, std::vector<Attractor>& attractors,
+                         float cullRadius, Vec2& force);
+
+// Same as simulateStep, but the attractors of every particle are summed in
+// id order, so the sums do not depend on the index, its builder or its
+// leaf order either. Every index, thread count and rank count gives the
+// same bits, at the cost of a gather and sort per particle. This is also
+// the order the *-ref.txt benchmark answers were summed in.
+template <typename SpatialIndex>
+void simulateStepById(const SpatialIndex& index,
+                      const std::vector<Particle>& particles,
+                      std::vector<Particle>& newParticles,
+                      StepParameters params,
+                      ThreadPool* pool,
+                      uint32_t* interactions = nullptr)
+{
+    const ParticleSoA& soa = index.particlesSoA;
+    parallelFor(pool, (uint32_t)particles.size(),
+                [&](uint32_t begin, uint32_t end) {
+        TraceSpan span("force chunk");
+        static thread_local std::vector<Attractor> attractors;
+        for (uint32_t i = begin; i < end; ++i) {
+            const auto& pi = particles[i];
+            attractors.clear();
+            index.forEachSpan(pi.position, params.cullRadius,
+                              [&](uint32_t spanBegin, uint32_t spanEnd) {
+                for (uint32_t j = spanBegin; j < spanEnd; j++)
+                    attractors.push_back({ soa.id[j], soa.positionX[j],
+                                           soa.positionY[j], soa.mass[j] });
+            });
+            if (interactions)
+                interactions[i] = (uint32_t)attractors.size();
+            COUNT(queries, 1);
+            COUNT(candidates, attractors.size());
+            Vec2 force = Vec2(0.0f, 0.0f);
+            accumulateForceById(pi, attractors, params.cullRadius, force);
+            newParticles[i] = updateParticle(pi, force, params.deltaTime);
+        }
+    }, SimulateChunkSize);
+}
+
+// Same as simulateStep, with the attractors taken from the Verlet lists
+// instead of an index query. local holds every particle within cullRadius
+// of the particles, localIndexOfId[id] its index in local if it is there.
+// Listed particles missing from local are farther than cullRadius. With
+// byId the forces are summed in id order, like simulateStepById.
+void simulateStepVerlet(const NeighborList& lists,
+                        const std::vector<Particle>& local,
+                        const std::vector<int>& localIndexOfId,
+                        const std::vector<Particle>& particles,
+                        std::vector<Particle>& newParticles,
+                        StepParameters params,
+                        ThreadPool* pool,
+                        uint32_t* interactions = nullptr,
+                        bool byId = false);
+
+#endif
@@ -0,0 +1,193 @@
+#include "snapshot.h"
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const uint32_t SnapshotFields = 5;
+const uint64_t SnapshotAlignment = 64;
+
+static uint64_t alignUp(uint64_t size)
+{
+  return (size + SnapshotAlignment - 1) / SnapshotAlignment * SnapshotAlignment;
+}
+
+static uint32_t swapBytes(uint32_t v)
+{
+  return (v >> 24) | ((v >> 8) & 0x0000ff00) | ((v << 8) & 0x00ff0000) | (v << 24);
+}
+
+static uint64_t swapBytes(uint64_t v)
+{
+  return ((uint64_t)swapBytes((uint32_t)v) << 32) | swapBytes((uint32_t)(v >> 32));
+}
+
+static float swapBytes(float f)
+{
+  uint32_t v;
+  memcpy(&v, &f, sizeof(v));
+  v = swapBytes(v);
+  memcpy(&f, &v, sizeof(v));
+  return f;
+}
+
+bool isSnapshotFile(const std::string& fileName)
+{
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  char magic[sizeof(SnapshotMagic)];
+  bool result = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) &&
+                memcmp(magic, SnapshotMagic, sizeof(magic)) == 0;
+  close(fd);
+  return result;
+}
+
+bool hasSnapshotSuffix(const std::string& fileName)
+{
+  size_t length = strlen(SnapshotSuffix);
+  return fileName.size() >= length &&
+         fileName.compare(fileName.size() - length, length, SnapshotSuffix) == 0;
+}
+
+bool loadSnapshot(const std::string& fileName, std::vector<Particle>& particles)
+{
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "error reading file \"" << fileName << "\"" << std::endl;
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (uint64_t)info.st_size < sizeof(SnapshotHeader)) {
+    std::cerr << "\"" << fileName << "\" is not a particle snapshot" << std::endl;
+    close(fd);
+    return false;
+  }
+  size_t fileSize = (size_t)info.st_size;
+  void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::cerr << "error mapping file \"" << fileName << "\"" << std::endl;
+    return false;
+  }
+  madvise(mapping, fileSize, MADV_SEQUENTIAL);
+  bool valid = readSnapshot((const char*)mapping, fileSize, particles);
+  if (!valid)
+    std::cerr << "\"" << fileName << "\" is not a supported particle snapshot"
+              << std::endl;
+  munmap(mapping, fileSize);
+  return valid;
+}
+
+bool readSnapshot(const char* data, size_t size, std::vector<Particle>& particles)
+{
+  if (size < sizeof(SnapshotHeader))
+    return false;
+  SnapshotHeader header;
+  memcpy(&header, data, sizeof(header));
+  bool swapped = header.byteOrder == swapBytes(SnapshotByteOrder);
+  if (swapped) {
+    header.version = swapBytes(header.version);
+    header.count = swapBytes(header.count);
+    header.layout = swapBytes(header.layout);
+    header.numFields = swapBytes(header.numFields);
+    header.blockStride = swapBytes(header.blockStride);
+    header.dataOffset = swapBytes(header.dataOffset);
+  }
+  bool valid = memcmp(header.magic, SnapshotMagic, sizeof(SnapshotMagic)) == 0 &&
+               (swapped || header.byteOrder == SnapshotByteOrder) &&
+               header.version == SnapshotVersion &&
+               header.layout == (uint32_t)SnapshotLayout::SoAFloat32 &&
+               header.numFields == SnapshotFields &&
+               // bounded before multiplying, so a corrupt header cannot
+               // wrap the size checks around
+               header.count <= size / sizeof(float) &&
+               header.dataOffset <= size &&
+               header.blockStride <= (size - header.dataOffset) / SnapshotFields &&
+               header.blockStride >= header.count * sizeof(float) &&
+               // the blocks are read as float arrays
+               header.dataOffset % sizeof(float) == 0 &&
+               header.blockStride % sizeof(float) == 0;
+  if (!valid)
+    return false;
+
+  const size_t n = (size_t)header.count;
+  const float* blocks[SnapshotFields];
+  for (uint32_t f = 0; f < SnapshotFields; f++)
+    blocks[f] = (const float*)(data + header.dataOffset + f * header.blockStride);
+  particles.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    Particle& p = particles[i];
+    p.id = (int)i;
+    p.mass = blocks[0][i];
+    p.position.x = blocks[1][i];
+    p.position.y = blocks[2][i];
+    p.velocity.x = blocks[3][i];
+    p.velocity.y = blocks[4][i];
+  }
+  if (swapped)
+    for (auto& p : particles) {
+      p.mass = swapBytes(p.mass);
+      p.position.x = swapBytes(p.position.x);
+      p.position.y = swapBytes(p.position.y);
+      p.velocity.x = swapBytes(p.velocity.x);
+      p.velocity.y = swapBytes(p.velocity.y);
+    }
+  return true;
+}
+
+void appendSnapshot(const std::vector<Particle>& particles,
+                    std::vector<char>& buffer)
+{
+  const size_t n = particles.size();
+  SnapshotHeader header;
+  memcpy(header.magic, SnapshotMagic, sizeof(SnapshotMagic));
+  header.version = SnapshotVersion;
+  header.byteOrder = SnapshotByteOrder;
+  header.count = n;
+  header.layout = (uint32_t)SnapshotLayout::SoAFloat32;
+  header.numFields = SnapshotFields;
+  header.blockStride = alignUp(n * sizeof(float));
+  header.dataOffset = alignUp(sizeof(SnapshotHeader));
+
+  // padding is zeroed
+  size_t base = buffer.size();
+  buffer.resize(base + header.dataOffset + header.blockStride * SnapshotFields, 0);
+  char* data = buffer.data() + base;
+  memcpy(data, &header, sizeof(header));
+  float* blocks[SnapshotFields];
+  for (uint32_t f = 0; f < SnapshotFields; f++)
+    blocks[f] = (float*)(data + header.dataOffset + f * header.blockStride);
+  for (size_t i = 0; i < n; i++) {
+    const Particle& p = particles[i];
+    blocks[0][i] = p.mass;
+    blocks[1][i] = p.position.x;
+    blocks[2][i] = p.position.y;
+    blocks[3][i] = p.velocity.x;
+    blocks[4][i] = p.velocity.y;
+  }
+}
+
+bool saveSnapshot(const std::string& fileName,
+                  const std::vector<Particle>& particles)
+{
+  // the whole file is assembled in memory
+  std::vector<char> buffer;
+  appendSnapshot(particles, buffer);
+  int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = fd >= 0;
+  for (size_t written = 0; ok && written < buffer.size();) {
+    // write may return early for large files
+    ssize_t result = write(fd, buffer.data() + written, buffer.size() - written);
+    ok = result > 0;
+    if (ok)
+      written += (size_t)result;
+  }
+  if (fd >= 0 && close(fd) != 0)
+    ok = false;
+  if (!ok)
+    std::cerr << "error writing file \"" << fileName << "\"" << std::endl;
+  return ok;
+}
@@ -0,0 +1,63 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "common.h"
+
+// Binary particle snapshots. The file is a SnapshotHeader followed by one
+// block of count floats per particle field, in the order mass, position x,
+// position y, velocity x, velocity y. Blocks start blockStride bytes apart
+// from dataOffset and are 64 byte aligned, so a mapped file can be read
+// as arrays without parsing. Particle ids are the indices, as with the
+// text format.
+//
+// Files are written in the byte order of the writer, which byteOrder
+// records; a reader with the other byte order swaps the values.
+
+const char SnapshotMagic[8] = { 'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P' };
+const uint32_t SnapshotVersion = 1;
+const uint32_t SnapshotByteOrder = 0x01020304;
+// file name suffix that makes saveToFile write a snapshot
+const char SnapshotSuffix[] = ".snap";
+
+enum class SnapshotLayout : uint32_t
+{
+    // one float32 block per field
+    SoAFloat32 = 1
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t count;
+    uint32_t layout;
+    uint32_t numFields;
+    uint64_t blockStride;
+    uint64_t dataOffset;
+};
+
+// true if the file starts with the snapshot magic
+bool isSnapshotFile(const std::string& fileName);
+// true if saveToFile writes fileName as a snapshot
+bool hasSnapshotSuffix(const std::string& fileName);
+
+// Maps the file and copies the blocks into particles. Returns false, with a
+// message on stderr, if the file cannot be read or is not a valid snapshot.
+bool loadSnapshot(const std::string& fileName, std::vector<Particle>& particles);
+// Writes the particles, in order, from one buffer holding the whole file.
+bool saveSnapshot(const std::string& fileName,
+                  const std::vector<Particle>& particles);
+
+// The file saveSnapshot writes, appended to buffer, and its reader from
+// memory, which returns false if data is not a valid snapshot. Used to
+// embed snapshots in other files, see checkpoint.h. The blocks are aligned
+// relative to the start of the snapshot.
+void appendSnapshot(const std::vector<Particle>& particles,
+                    std::vector<char>& buffer);
+bool readSnapshot(const char* data, size_t size, std::vector<Particle>& particles);
+
+#endif
@@ -0,0 +1,252 @@
+#include "text-format.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "thread-pool.h"
+
+// smallest chunk worth handing to a thread when parsing
+const size_t MinParseChunkBytes = 64 * 1024;
+// particles formatted per chunk when writing
+const uint32_t FormatChunkSize = 8192;
+
+// powers of ten that are exact doubles
+static const double ExactPowersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isDigit(char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+// (float)atof of the field, for fields the fast path does not handle
+static float parseFieldSlow(const char* begin, const char* end)
+{
+  char buffer[64];
+  size_t length = (size_t)(end - begin);
+  if (length >= sizeof(buffer))
+    return (float)atof(std::string(begin, end).c_str());
+  memcpy(buffer, begin, length);
+  buffer[length] = '\0';
+  return (float)atof(buffer);
+}
+
+// Returns (float)atof of the field. Plain decimals with at most 19
+// significant digits and a small exponent are converted with one exact
+// multiplication or division of doubles, which rounds like strtod; anything
+// else (whitespace, hex, inf, long mantissas) is left to atof.
+static float parseField(const char* begin, const char* end)
+{
+  const char* p = begin;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+'))
+    negative = *p++ == '-';
+  uint64_t mantissa = 0;
+  int digits = 0, exponent = 0;
+  bool anyDigits = false;
+  for (; p < end && isDigit(*p); p++) {
+    anyDigits = true;
+    if (mantissa == 0 && *p == '0')
+      continue;
+    if (++digits > 19)
+      return parseFieldSlow(begin, end);
+    mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+  }
+  if (p < end && *p == '.')
+    for (p++; p < end && isDigit(*p); p++) {
+      anyDigits = true;
+      exponent--;
+      if (mantissa == 0 && *p == '0')
+        continue;
+      if (++digits > 19)
+        return parseFieldSlow(begin, end);
+      mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+    }
+  if (!anyDigits || (p < end && (*p == 'x' || *p == 'X')))
+    return parseFieldSlow(begin, end);
+  // an exponent only counts with at least one digit, like in strtod
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char* q = p + 1;
+    bool negativeExponent = false;
+    if (q < end && (*q == '-' || *q == '+'))
+      negativeExponent = *q++ == '-';
+    if (q < end && isDigit(*q)) {
+      int value = 0;
+      for (; q < end && isDigit(*q); q++)
+        if (value < 100000)
+          value = value * 10 + (*q - '0');
+      exponent += negativeExponent ? -value : value;
+    }
+  }
+
+  double value;
+  if (mantissa == 0)
+    value = 0.0;
+  else if (mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22)
+    value = exponent < 0 ? (double)mantissa / ExactPowersOfTen[-exponent]
+                         : (double)mantissa * ExactPowersOfTen[exponent];
+  else
+    return parseFieldSlow(begin, end);
+  return (float)(negative ? -value : value);
+}
+
+// the original loader, for lines without the four separating spaces
+static void parseLineSlow(const char* begin, const char* end, Particle& particle)
+{
+  std::stringstream sstream(std::string(begin, end));
+  std::string str;
+  std::getline(sstream, str, ' ');
+  particle.mass = (float)atof(str.c_str());
+  std::getline(sstream, str, ' ');
+  particle.position.x = (float)atof(str.c_str());
+  std::getline(sstream, str, ' ');
+  particle.position.y = (float)atof(str.c_str());
+  std::getline(sstream, str, ' ');
+  particle.velocity.x = (float)atof(str.c_str());
+  std::getline(sstream, str, '\n');
+  particle.velocity.y = (float)atof(str.c_str());
+}
+
+static void parseLine(const char* begin, const char* end, Particle& particle)
+{
+  const char* fields[5];
+  fields[0] = begin;
+  for (int f = 1; f < 5; f++) {
+    const char* space = (const char*)memchr(fields[f - 1], ' ', end - fields[f - 1]);
+    if (!space) {
+      parseLineSlow(begin, end, particle);
+      return;
+    }
+    fields[f] = space + 1;
+  }
+  particle.mass = parseField(fields[0], fields[1] - 1);
+  particle.position.x = parseField(fields[1], fields[2] - 1);
+  particle.position.y = parseField(fields[2], fields[3] - 1);
+  particle.velocity.x = parseField(fields[3], fields[4] - 1);
+  // the last field runs to the end of the line
+  particle.velocity.y = parseField(fields[4], end);
+}
+
+bool loadText(const std::string& fileName, std::vector<Particle>& particles,
+              ThreadPool* pool)
+{
+  particles.clear();
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return false;
+  }
+  const size_t size = (size_t)info.st_size;
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+  const char* data = (const char*)mapping;
+
+  // chunks start at line starts; a line ends at '\n' or, for the last
+  // line, at the end of the file
+  size_t numChunks = std::max((size_t)1, size / MinParseChunkBytes);
+  numChunks = std::min(numChunks, (size_t)(pool ? 8 * pool->numThreads() : 1));
+  std::vector<size_t> chunkBegin(numChunks + 1);
+  for (size_t c = 0; c < numChunks; c++) {
+    size_t start = size * c / numChunks;
+    if (start > 0) {
+      const char* newline = (const char*)memchr(data + start - 1, '\n',
+                                                size - (start - 1));
+      start = newline ? (size_t)(newline - data) + 1 : size;
+    }
+    chunkBegin[c] = start;
+  }
+  chunkBegin[numChunks] = size;
+
+  // count the lines of every chunk, then parse them at their final index
+  std::vector<uint32_t> chunkFirstLine(numChunks + 1, 0);
+  parallelFor(pool, (uint32_t)numChunks, [&](uint32_t firstChunk, uint32_t lastChunk) {
+    for (uint32_t c = firstChunk; c < lastChunk; c++) {
+      const char* p = data + chunkBegin[c];
+      const char* end = data + std::max(chunkBegin[c], chunkBegin[c + 1]);
+      uint32_t lines = 0;
+      while (p < end) {
+        const char* newline = (const char*)memchr(p, '\n', end - p);
+        lines++;
+        p = newline ? newline + 1 : end;
+      }
+      chunkFirstLine[c + 1] = lines;
+    }
+  }, 1);
+  for (size_t c = 0; c < numChunks; c++)
+    chunkFirstLine[c + 1] += chunkFirstLine[c];
+
+  particles.resize(chunkFirstLine[numChunks]);
+  parallelFor(pool, (uint32_t)numChunks, [&](uint32_t firstChunk, uint32_t lastChunk) {
+    for (uint32_t c = firstChunk; c < lastChunk; c++) {
+      const char* p = data + chunkBegin[c];
+      const char* end = data + std::max(chunkBegin[c], chunkBegin[c + 1]);
+      uint32_t index = chunkFirstLine[c];
+      while (p < end) {
+        const char* newline = (const char*)memchr(p, '\n', end - p);
+        const char* lineEnd = newline ? newline : end;
+        Particle& particle = particles[index];
+        parseLine(p, lineEnd, particle);
+        particle.id = (int)index++;
+        p = newline ? newline + 1 : end;
+      }
+    }
+  }, 1);
+  munmap(mapping, size);
+  return true;
+}
+
+bool saveText(const std::string& fileName,
+              const std::vector<Particle>& particles, ThreadPool* pool)
+{
+  const uint32_t n = (uint32_t)particles.size();
+  uint32_t numChunks = (n + FormatChunkSize - 1) / FormatChunkSize;
+  std::vector<std::vector<char>> buffers(numChunks);
+  parallelFor(pool, numChunks, [&](uint32_t firstChunk, uint32_t lastChunk) {
+    for (uint32_t c = firstChunk; c < lastChunk; c++) {
+      std::vector<char>& buffer = buffers[c];
+      uint32_t begin = c * FormatChunkSize;
+      uint32_t end = std::min(begin + FormatChunkSize, n);
+      // five %.9g values take at most 16 characters each
+      buffer.resize((size_t)(end - begin) * 5 * 17);
+      size_t used = 0;
+      for (uint32_t i = begin; i < end; i++) {
+        const Particle& p = particles[i];
+        // an ostream with setprecision(9) formats floats as %.9g of the
+        // value as double
+        used += snprintf(buffer.data() + used, buffer.size() - used,
+                         "%.9g %.9g %.9g %.9g %.9g\n",
+                         (double)p.mass, (double)p.position.x,
+                         (double)p.position.y, (double)p.velocity.x,
+                         (double)p.velocity.y);
+      }
+      buffer.resize(used);
+    }
+  }, 1);
+
+  FILE* file = fopen(fileName.c_str(), "wb");
+  bool ok = file != nullptr;
+  for (uint32_t c = 0; ok && c < numChunks; c++)
+    ok = fwrite(buffers[c].data(), 1, buffers[c].size(), file) == buffers[c].size();
+  if (file && fclose(file) != 0)
+    ok = false;
+  if (!ok)
+    std::cerr << "error writing file \"" << fileName << "\"" << std::endl;
+  return ok;
+}
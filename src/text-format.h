@@ -0,0 +1,26 @@
+#ifndef TEXT_FORMAT_H
+#define TEXT_FORMAT_H
+
+#include <string>
+#include <vector>
+#include "common.h"
+
+class ThreadPool;
+
+// The text particle format, one "mass x y vx vy" line per particle with
+// the line number as id.
+//
+// loadText maps the file, cuts it into chunks at line boundaries and
+// parses the chunks in parallel without allocating per line. Every value
+// is exactly what (float)atof gives for its field, and lines that do not
+// have the usual five fields go through the original stringstream parser,
+// so the particles are bit identical to the ones it reads.
+bool loadText(const std::string& fileName, std::vector<Particle>& particles,
+              ThreadPool* pool);
+
+// Formats ranges of particles in parallel into buffers and writes them in
+// order. The text is identical to an ostream with setprecision(9).
+bool saveText(const std::string& fileName,
+              const std::vector<Particle>& particles, ThreadPool* pool);
+
+#endif
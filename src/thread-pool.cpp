@@ -0,0 +1,106 @@
+#include "thread-pool.h"
+#include "trace.h"
+
+ThreadPool::ThreadPool(int numThreads)
+  : queues(numThreads < 1 ? 1 : numThreads)
+{
+  for (int i = 1; i < (int)queues.size(); i++)
+    threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto& thread : threads)
+    thread.join();
+}
+
+void ThreadPool::run(ChunkFn fn, void* context, uint32_t numChunks)
+{
+  const int n = numThreads();
+  for (int i = 0; i < n; i++) {
+    std::lock_guard<std::mutex> guard(queues[i].lock);
+    queues[i].begin = (uint32_t)((uint64_t)numChunks * i / n);
+    queues[i].end = (uint32_t)((uint64_t)numChunks * (i + 1) / n);
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    chunkFn = fn;
+    chunkContext = context;
+    activeWorkers = n - 1;
+    generation++;
+  }
+  wake.notify_all();
+
+  drain(0);
+
+  // the queues and the loop state are reused by the next loop, so wait
+  // until no worker can still be looking at them
+  std::unique_lock<std::mutex> guard(mutex);
+  done.wait(guard, [&] { return activeWorkers == 0; });
+}
+
+void ThreadPool::drain(int self)
+{
+  ChunkQueue& own = queues[self];
+  for (;;) {
+    uint32_t chunk;
+    {
+      std::lock_guard<std::mutex> guard(own.lock);
+      if (own.begin == own.end)
+        chunk = UINT32_MAX;
+      else
+        chunk = own.begin++;
+    }
+    if (chunk != UINT32_MAX)
+      chunkFn(chunkContext, chunk);
+    else if (!steal(self))
+      return;
+  }
+}
+
+// Moves the back half of another thread's remaining chunks to our queue.
+// Returns false once every queue is empty.
+bool ThreadPool::steal(int self)
+{
+  const int n = numThreads();
+  for (int i = 1; i < n; i++) {
+    ChunkQueue& victim = queues[(self + i) % n];
+    uint32_t begin, end;
+    {
+      std::lock_guard<std::mutex> guard(victim.lock);
+      if (victim.begin == victim.end)
+        continue;
+      end = victim.end;
+      begin = victim.begin + (victim.end - victim.begin) / 2;
+      victim.end = begin;
+    }
+    std::lock_guard<std::mutex> guard(queues[self].lock);
+    queues[self].begin = begin;
+    queues[self].end = end;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::workerLoop(int self)
+{
+  setTraceThreadName("pool worker " + std::to_string(self));
+  uint64_t seen = 0;
+  std::unique_lock<std::mutex> guard(mutex);
+  for (;;) {
+    wake.wait(guard, [&] { return stopping || generation != seen; });
+    if (stopping)
+      return;
+    seen = generation;
+    guard.unlock();
+    drain(self);
+    guard.lock();
+    if (--activeWorkers == 0)
+      done.notify_one();
+  }
+}
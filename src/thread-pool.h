@@ -0,0 +1,99 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// A fixed set of worker threads that run parallel loops with work
+// stealing. A loop is cut into chunks and every thread starts on an equal
+// contiguous block of them. A thread that runs out steals the back half of
+// another thread's remaining block, so clustered scenes, where a few chunks
+// cost far more than the rest, still keep every thread busy.
+//
+// The calling thread takes part in every loop, so a pool of one thread
+// runs loops inline.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int numThreads);
+    ~ThreadPool();
+
+    int numThreads() const { return (int)queues.size(); }
+
+    // Calls fn(begin, end) for consecutive ranges of at most grain indices
+    // covering [0, count), and returns once all of them finished. Ranges
+    // run concurrently, in no particular order.
+    template <typename Fn>
+    void parallelFor(uint32_t count, uint32_t grain, Fn&& fn);
+
+private:
+    typedef void (*ChunkFn)(void* context, uint32_t chunk);
+
+    // chunks [begin, end) not yet started by the owning thread
+    struct alignas(64) ChunkQueue
+    {
+        std::mutex lock;
+        uint32_t begin = 0, end = 0;
+    };
+
+    void run(ChunkFn fn, void* context, uint32_t numChunks);
+    void drain(int self);
+    bool steal(int self);
+    void workerLoop(int self);
+
+    std::vector<ChunkQueue> queues;
+    std::vector<std::thread> threads;
+
+    // current loop, published under mutex with a new generation
+    ChunkFn chunkFn = nullptr;
+    void* chunkContext = nullptr;
+
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    uint64_t generation = 0;
+    int activeWorkers = 0;
+    bool stopping = false;
+};
+
+template <typename Fn>
+void ThreadPool::parallelFor(uint32_t count, uint32_t grain, Fn&& fn)
+{
+    if (grain == 0)
+        grain = 1;
+    uint32_t numChunks = (count + grain - 1) / grain;
+    if (numChunks <= 1 || numThreads() == 1) {
+        if (count > 0)
+            fn((uint32_t)0, count);
+        return;
+    }
+    typedef typename std::remove_reference<Fn>::type Function;
+    struct Loop
+    {
+        Function* fn;
+        uint32_t count, grain;
+    } loop = { &fn, count, grain };
+    run([](void* context, uint32_t chunk) {
+            Loop& l = *(Loop*)context;
+            uint32_t begin = chunk * l.grain;
+            uint32_t end = begin + l.grain < l.count ? begin + l.grain : l.count;
+            (*l.fn)(begin, end);
+        }, &loop, numChunks);
+}
+
+// Runs pool->parallelFor, or the whole range inline when pool is null.
+template <typename Fn>
+void parallelFor(ThreadPool* pool, uint32_t count, Fn&& fn,
+                 uint32_t grain = 4096)
+{
+    if (pool)
+        pool->parallelFor(count, grain, fn);
+    else if (count > 0)
+        fn((uint32_t)0, count);
+}
+
+#endif
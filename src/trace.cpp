@@ -0,0 +1,136 @@
+#include "trace.h"
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+bool tracingEnabled = false;
+
+struct TraceEvent
+{
+    const char* name;
+    int64_t begin, end;
+};
+
+// written only by its thread; the count is published with release so the
+// thread writing the trace sees complete events
+struct TraceBuffer
+{
+    std::string threadName;
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> written;
+};
+
+typedef std::chrono::steady_clock TraceClock;
+static TraceClock::time_point traceOrigin;
+static int traceRank = 0;
+
+// buffers of every thread that traced; they live until the process ends
+static std::mutex registryMutex;
+static std::vector<TraceBuffer*> registry;
+static thread_local TraceBuffer* threadBuffer = nullptr;
+
+void startTrace(int rank)
+{
+  traceRank = rank;
+  traceOrigin = TraceClock::now();
+  tracingEnabled = true;
+}
+
+int64_t traceNow()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           TraceClock::now() - traceOrigin).count();
+}
+
+static TraceBuffer* getThreadBuffer()
+{
+  if (!threadBuffer) {
+    threadBuffer = new TraceBuffer();
+    threadBuffer->events.resize(TraceBufferEvents);
+    threadBuffer->written.store(0, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> guard(registryMutex);
+    threadBuffer->threadName = "thread " + std::to_string(registry.size());
+    registry.push_back(threadBuffer);
+  }
+  return threadBuffer;
+}
+
+void recordTraceSpan(const char* name, int64_t begin, int64_t end)
+{
+  TraceBuffer* buffer = getThreadBuffer();
+  uint64_t written = buffer->written.load(std::memory_order_relaxed);
+  TraceEvent& event = buffer->events[written % TraceBufferEvents];
+  event.name = name;
+  event.begin = begin;
+  event.end = end;
+  buffer->written.store(written + 1, std::memory_order_release);
+}
+
+void setTraceThreadName(const std::string& name)
+{
+  if (!tracingEnabled)
+    return;
+  TraceBuffer* buffer = getThreadBuffer();
+  std::lock_guard<std::mutex> guard(registryMutex);
+  buffer->threadName = name;
+}
+
+static void appendf(std::string& out, const char* format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void appendf(std::string& out, const char* format, ...)
+{
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length > 0)
+    out.append(line, length < (int)sizeof(line) ? length : (int)sizeof(line) - 1);
+}
+
+std::string traceEventsJson()
+{
+  std::string out;
+  if (!tracingEnabled)
+    return out;
+  std::lock_guard<std::mutex> guard(registryMutex);
+  appendf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+          "\"args\": {\"name\": \"rank %d\"}}", traceRank, traceRank);
+  for (size_t tid = 0; tid < registry.size(); tid++) {
+    const TraceBuffer* buffer = registry[tid];
+    uint64_t written = buffer->written.load(std::memory_order_acquire);
+    uint64_t first = written > TraceBufferEvents ? written - TraceBufferEvents : 0;
+    std::string name = buffer->threadName;
+    if (first > 0)
+      name += " (" + std::to_string(first) + " early spans dropped)";
+    appendf(out, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"tid\": %zu, \"args\": {\"name\": \"%s\"}}", traceRank, tid,
+            name.c_str());
+    for (uint64_t e = first; e < written; e++) {
+      const TraceEvent& event = buffer->events[e % TraceBufferEvents];
+      // timestamps are in microseconds
+      appendf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, "
+              "\"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f}", event.name,
+              traceRank, tid, event.begin * 1e-3, (event.end - event.begin) * 1e-3);
+    }
+  }
+  return out;
+}
+
+bool writeTraceFile(const std::string& fileName, const std::string& events)
+{
+  FILE* file = fopen(fileName.c_str(), "w");
+  if (!file) {
+    fprintf(stderr, "error writing file \"%s\"\n", fileName.c_str());
+    return false;
+  }
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fwrite(events.data(), 1, events.size(), file);
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  return true;
+}
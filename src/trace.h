@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <string>
+
+// Timeline tracing in the Chrome trace format, which chrome://tracing and
+// Perfetto open. A TraceSpan around a phase records its begin and end on
+// the calling thread; every thread writes into its own ring buffer with no
+// locks, so the pool workers can trace their chunks of a parallel loop.
+// Each buffer keeps its last TraceBufferEvents spans.
+//
+// Tracing is off until startTrace, so an unused TraceSpan costs a branch.
+
+const uint32_t TraceBufferEvents = 1 << 16;
+
+// set by startTrace, before any thread that traces is started
+extern bool tracingEnabled;
+
+// Enables tracing with time 0 at this call. Ranks call it right after a
+// barrier so their timelines line up.
+void startTrace(int rank);
+
+// nanoseconds since startTrace
+int64_t traceNow();
+
+// name must outlive the trace, usually a string literal
+void recordTraceSpan(const char* name, int64_t begin, int64_t end);
+
+// Names the calling thread in the trace, otherwise it is "thread <n>".
+void setTraceThreadName(const std::string& name);
+
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char* name)
+        : name(name), begin(tracingEnabled ? traceNow() : -1) {}
+    ~TraceSpan()
+    {
+        if (begin >= 0)
+            recordTraceSpan(name, begin, traceNow());
+    }
+
+private:
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+
+    const char* name;
+    int64_t begin;
+};
+
+// The events of every thread of this process as comma separated trace
+// event objects, with the rank as process id. No thread may be tracing
+// meanwhile.
+std::string traceEventsJson();
+
+// Writes the events of all ranks, as returned by traceEventsJson, into one
+// trace file.
+bool writeTraceFile(const std::string& fileName, const std::string& events);
+
+#endif
@@ -0,0 +1,122 @@
+#include "uniform-grid.h"
+#include <iostream>
+
+void UniformGrid::getParticles(std::vector<Particle>& particles, Vec2 position,
+                               float radius) const {
+    forEachParticle(position, radius,
+                    [&](const Particle& p) { particles.push_back(p); });
+}
+
+void UniformGrid::getParticles(ParticleSoA& particles, Vec2 position,
+                               float radius) const {
+    forEachParticle(position, radius,
+                    [&](const Particle& p) { particles.push_back(p); });
+}
+
+bool UniformGrid::checkGrid()
+{
+  const uint32_t numCells = (uint32_t)cellsX * (uint32_t)cellsY;
+  if (cellBegin.size() != numCells + 1 || cellBegin[numCells] != particles.size()) {
+    std::cout << "grid cell table does not cover " << particles.size()
+              << " particles" << std::endl;
+    return false;
+  }
+  for (int y = 0; y < cellsY; y++) {
+    for (int x = 0; x < cellsX; x++) {
+      uint32_t cell = y * cellsX + x;
+      if (cellBegin[cell] > cellBegin[cell + 1]) {
+        std::cout << "cell (" << x << ", " << y << ") has a negative range"
+                  << std::endl;
+        return false;
+      }
+      for (uint32_t i = cellBegin[cell]; i < cellBegin[cell + 1]; i++) {
+        const Particle& p = particles[i];
+        if (cellX(p.position.x) != x || cellY(p.position.y) != y) {
+          std::cout << "particle: " << p.id
+                    << "(" << p.position.x << ", " << p.position.y << ")"
+                    << " outside of cell (" << x << ", " << y << ")"
+                    << std::endl;
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// cap on the number of cells per particle, beyond it cells are enlarged
+const int MaxGridCellsPerParticle = 4;
+
+void UniformGrid::countLeaves() const
+{
+  if (!CountersEnabled)
+    return;
+  for (size_t c = 0; c + 1 < cellBegin.size(); c++) {
+    COUNT(leaves, 1);
+    COUNT_BIN(leafOccupancy, leafOccupancyBin(cellBegin[c + 1] - cellBegin[c]));
+  }
+}
+
+bool buildUniformGrid(const std::vector<Particle>& particles, UniformGrid& grid,
+                      float cellSize)
+{
+  Vec2 bmin, bmax;
+  computeBounds(particles, bmin, bmax);
+  return buildUniformGrid(particles, grid, cellSize, bmin, bmax,
+                          particles.size());
+}
+
+bool buildUniformGrid(const std::vector<Particle>& particles, UniformGrid& grid,
+                      float cellSize, Vec2 bmin, Vec2 bmax,
+                      size_t totalParticles)
+{
+  const uint32_t n = (uint32_t)particles.size();
+  grid.bmin = bmin;
+  grid.bmax = bmax;
+
+  Vec2 extent = grid.bmax - grid.bmin;
+  double maxCells = (double)MaxGridCellsPerParticle * totalParticles + 1.0;
+  for (;;) {
+    double cellsX = floor(extent.x / cellSize) + 1.0;
+    double cellsY = floor(extent.y / cellSize) + 1.0;
+    if (totalParticles == 0 || cellsX * cellsY <= maxCells) {
+      grid.cellsX = totalParticles == 0 ? 1 : (int)cellsX;
+      grid.cellsY = totalParticles == 0 ? 1 : (int)cellsY;
+      break;
+    }
+    cellSize *= 2.0f;
+  }
+  grid.cellSize = cellSize;
+  grid.invCellSize = 1.0f / cellSize;
+
+  // counting sort by cell; the scatter is stable so particles keep their
+  // input order within each cell
+  const uint32_t numCells = (uint32_t)grid.cellsX * (uint32_t)grid.cellsY;
+  grid.cellBegin.assign(numCells + 1, 0);
+  grid.cellOf.resize(n);
+  for (uint32_t i = 0; i < n; i++) {
+    const Vec2& p = particles[i].position;
+    uint32_t cell = grid.cellY(p.y) * grid.cellsX + grid.cellX(p.x);
+    grid.cellOf[i] = cell;
+    grid.cellBegin[cell + 1]++;
+  }
+  for (uint32_t c = 0; c < numCells; c++)
+    grid.cellBegin[c + 1] += grid.cellBegin[c];
+
+  // cellOf becomes the next free slot of each particle's cell
+  grid.particles.resize(n);
+  std::vector<uint32_t>& offset = grid.cellOf;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t cell = offset[i];
+    offset[i] = grid.cellBegin[cell]++;
+  }
+  for (uint32_t i = 0; i < n; i++)
+    grid.particles[offset[i]] = particles[i];
+  // the increments shifted every begin to the next cell's begin
+  for (uint32_t c = numCells; c > 0; c--)
+    grid.cellBegin[c] = grid.cellBegin[c - 1];
+  grid.cellBegin[0] = 0;
+
+  grid.particlesSoA.assign(grid.particles);
+  return grid.checkGrid();
+}
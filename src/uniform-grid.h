@@ -0,0 +1,147 @@
+#ifndef UNIFORM_GRID_H
+#define UNIFORM_GRID_H
+
+#include <cstdint>
+#include "common.h"
+#include "counters.h"
+
+// A uniform grid of square cells over the particle bounds. Every query in
+// the simulator uses the same cullRadius, so with cells about cullRadius
+// wide a query only scans the 3x3 block of cells around the query point.
+//
+// Cells are numbered row by row, cell (x, y) is cellBegin index
+// y * cellsX + x, and particles are sorted by cell, so the particles of one
+// row of cells are a single contiguous span. The query interface matches
+// QuadTree so simulateStep can run on either index.
+class UniformGrid {
+public:
+    // particles grouped by cell, in row-major cell order
+    std::vector<Particle> particles;
+    // the same particles as structure of arrays, for the batched force kernels
+    ParticleSoA particlesSoA;
+    // cell c holds particles[cellBegin[c], cellBegin[c + 1])
+    std::vector<uint32_t> cellBegin;
+    // cell index of every input particle, used during construction
+    std::vector<uint32_t> cellOf;
+    // the bounds of all particles
+    Vec2 bmin, bmax;
+    float cellSize = 1.0f, invCellSize = 1.0f;
+    int cellsX = 0, cellsY = 0;
+
+    void getParticles(std::vector<Particle>& particles,
+                      Vec2 position,
+                      float radius) const;
+    void getParticles(ParticleSoA& particles,
+                      Vec2 position,
+                      float radius) const;
+
+    // Same as the QuadTree visitors: forEachParticle visits particles within
+    // radius, forEachLeafRange passes the particle range of every non empty
+    // cell that can hold such a particle, and forEachSpan merges the cells
+    // of each row into one span. Ranges are not filtered by distance.
+    template <typename Visitor>
+    void forEachParticle(Vec2 position, float radius, Visitor&& visitor) const;
+    template <typename Visitor>
+    void forEachLeafRange(Vec2 position, float radius, Visitor&& visitor) const;
+    template <typename Visitor>
+    void forEachSpan(Vec2 position, float radius, Visitor&& visitor) const;
+
+    inline int cellX(float x) const
+    {
+        return cellCoord((x - bmin.x) * invCellSize, cellsX);
+    }
+    inline int cellY(float y) const
+    {
+        return cellCoord((y - bmin.y) * invCellSize, cellsY);
+    }
+
+    bool checkGrid();
+    // adds the cells and their occupancy to the hot path counters, as leaves
+    void countLeaves() const;
+
+private:
+    // clamps before converting, query points can lie far outside the grid
+    static inline int cellCoord(float f, int cells)
+    {
+        return f <= 0.0f ? 0 : f >= (float)(cells - 1) ? cells - 1 : (int)f;
+    }
+
+    // Calls visitor(row, x0, x1) for every row of cells intersecting the
+    // square of half width radius around position, with the inclusive
+    // column range in that row.
+    template <typename Visitor>
+    void forEachRow(Vec2 position, float radius, Visitor& visitor) const;
+};
+
+template <typename Visitor>
+void UniformGrid::forEachRow(Vec2 position, float radius,
+                             Visitor& visitor) const
+{
+    if (cellBegin.empty())
+        return;
+    // The cell of a coordinate is monotonic in it, so the cells of the
+    // square's corners bound every cell it touches. The radius is padded so
+    // rounding in (position - radius) can never drop a particle the distance
+    // test would accept.
+    float reach = radius * 1.0001f;
+    int x0 = cellX(position.x - reach), x1 = cellX(position.x + reach);
+    int y0 = cellY(position.y - reach), y1 = cellY(position.y + reach);
+    COUNT(nodesVisited, (uint64_t)(y1 - y0 + 1) * (x1 - x0 + 1));
+    for (int y = y0; y <= y1; y++)
+        visitor(y, x0, x1);
+}
+
+template <typename Visitor>
+void UniformGrid::forEachLeafRange(Vec2 position, float radius,
+                                   Visitor&& visitor) const
+{
+    auto row = [&](int y, int x0, int x1) {
+        const uint32_t* cells = cellBegin.data() + y * cellsX;
+        for (int x = x0; x <= x1; x++)
+            if (cells[x] != cells[x + 1])
+                visitor(cells[x], cells[x + 1]);
+    };
+    forEachRow(position, radius, row);
+}
+
+template <typename Visitor>
+void UniformGrid::forEachSpan(Vec2 position, float radius,
+                              Visitor&& visitor) const
+{
+    auto row = [&](int y, int x0, int x1) {
+        const uint32_t* cells = cellBegin.data() + y * cellsX;
+        if (cells[x0] != cells[x1 + 1])
+            visitor(cells[x0], cells[x1 + 1]);
+    };
+    forEachRow(position, radius, row);
+}
+
+template <typename Visitor>
+void UniformGrid::forEachParticle(Vec2 position, float radius,
+                                  Visitor&& visitor) const
+{
+    forEachSpan(position, radius, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            const Particle& p = particles[i];
+            if ((position - p.position).length() < radius)
+                visitor(p);
+        }
+    });
+}
+
+// Builds the grid with cells of (at least) cellSize. The cell size grows
+// when the bounds would need more than a few cells per particle, which
+// keeps memory bounded when particles fly apart; queries stay correct for
+// any cell size.
+bool buildUniformGrid(const std::vector<Particle>& particles, UniformGrid& grid,
+                      float cellSize);
+// Same, over the given bounds, which must contain the particles, and with
+// the cell size capped for totalParticles. Ranks that hold part of a
+// particle set pass the global bounds and count, so they all build the
+// cells of the global grid.
+bool buildUniformGrid(const std::vector<Particle>& particles, UniformGrid& grid,
+                      float cellSize, Vec2 bmin, Vec2 bmax,
+                      size_t totalParticles);
+
+#endif
@@ -0,0 +1,264 @@
+// Runs the jobs of a manifest in one process, e.g. a parameter sweep, on a
+// shared thread pool, so jobs pay neither a process launch nor a reload of
+// their input.
+//
+// The manifest has one job per line, written as simulator options: the
+// input (-in, or -n, -scene and -seed for a generated scene), parameters
+// (-s, -cull, -dt), iterations (-i) and output (-o). Blank lines and lines
+// starting with # are skipped. Every job must name its own output; a
+// manifest with a job without -o, or with two jobs writing the same file,
+// is rejected before anything runs. A job runs the quad tree step of a single
+// process run and writes what nbody-release -np 1 writes with the same
+// options; of the engine options -tree, -leaf-size, -fan-out,
+// -deterministic and -leaf-batch apply, the others are ignored.
+//
+// Every distinct input is loaded or generated once and shared by its jobs.
+// A job's cost is estimated as its particle steps times the neighbors
+// expected within the cull radius. Jobs costing more than a thread's share
+// of the total run alone on the whole pool, the rest run concurrently, one
+// per thread, largest first. The headline is the particle steps simulated
+// per second of wall time, loading included. Jobs whose input cannot be
+// read are skipped; if any job was skipped or could not write its output,
+// the batch exits with status 1.
+//
+// usage: nbody-batch [-t threads] <manifest>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "force-kernel.h"
+#include "leaf-batch.h"
+#include "quad-tree.h"
+#include "scene-generator.h"
+#include "simulate-step.h"
+#include "thread-pool.h"
+#include "timing.h"
+
+struct Job
+{
+    // manifest line, for messages
+    int line = 0;
+    StartupOptions options;
+    StepParameters params;
+    // index into the shared inputs
+    int input = 0;
+    double cost = 0.0;
+    double seconds = 0.0;
+    // the output could not be written
+    bool failed = false;
+};
+
+struct Input
+{
+    // the input file, or the generator options
+    std::string key;
+    std::vector<Particle> particles;
+    // could not be read; its jobs are skipped
+    bool failed = false;
+};
+
+static std::string inputKey(const StartupOptions& options)
+{
+  if (!options.inputFile.empty())
+    return options.inputFile;
+  char key[256];
+  snprintf(key, sizeof(key), "%s n=%d s=%g seed=%llu",
+           sceneTypeName(options.scene), options.numParticles,
+           options.spaceSize, options.seed);
+  return key;
+}
+
+static bool readManifest(const std::string& fileName, std::vector<Job>& jobs)
+{
+  std::ifstream file(fileName);
+  if (!file) {
+    fprintf(stderr, "error reading file \"%s\"\n", fileName.c_str());
+    return false;
+  }
+  // the line of the first job writing each output
+  std::map<std::string, int> outputs;
+  bool valid = true;
+  std::string line;
+  for (int number = 1; std::getline(file, line); number++) {
+    std::istringstream stream(line);
+    std::vector<std::string> words(1, "nbody-batch");
+    std::string word;
+    while (stream >> word)
+      words.push_back(word);
+    if (words.size() == 1 || words[1][0] == '#')
+      continue;
+    std::vector<char*> argv;
+    for (auto& w : words)
+      argv.push_back(&w[0]);
+    Job job;
+    job.line = number;
+    job.options = parseOptions((int)argv.size(), argv.data());
+    job.params = getStepParams(job.options);
+    // parseOptions takes -o only with a value after it
+    auto o = std::find(words.begin(), words.end(), std::string("-o"));
+    if (o == words.end() || o + 1 == words.end()) {
+      fprintf(stderr, "line %d: the job has no output, -o\n", number);
+      valid = false;
+    } else if (!outputs.insert(std::make_pair(job.options.outputFile, number)).second) {
+      fprintf(stderr, "line %d: output \"%s\" is also written by line %d\n",
+              number, job.options.outputFile.c_str(),
+              outputs[job.options.outputFile]);
+      valid = false;
+    }
+    jobs.push_back(job);
+  }
+  return valid;
+}
+
+// Steps a copy of the input and saves it; pool is null for the jobs that
+// share the pool with others.
+static void runJob(Job& job, const std::vector<Particle>& input,
+                   ThreadPool* pool)
+{
+  const StartupOptions& options = job.options;
+  Timer t;
+  std::vector<Particle> particles(input), newParticles(input.size());
+  QuadTree tree;
+  if (isQuadTreeLeafSize(options.leafSize))
+    tree.leafSize = options.leafSize;
+  if (options.fanOut == 4 || options.fanOut == 16)
+    tree.fanOut = options.fanOut;
+  LeafBatchedForces leafBatch;
+  for (int i = 0; i < options.numIterations; i++) {
+    Vec2 bmin, bmax;
+    computeBounds(particles, bmin, bmax);
+    buildQuadTree(particles, tree, options.treeBuilder, bmin, bmax, pool);
+    if (options.deterministic)
+      simulateStepById(tree, particles, newParticles, job.params, pool);
+    else if (options.leafBatch)
+      leafBatch.simulateStep(tree, particles, newParticles, job.params,
+                             particles.size(), pool);
+    else
+      simulateStep(tree, particles, newParticles, job.params, pool);
+    particles.swap(newParticles);
+  }
+  job.failed = !saveToFile(options.outputFile, particles, pool);
+  job.seconds = t.elapsed();
+}
+
+int main(int argc, char *argv[]) {
+  int numThreads = 1;
+  std::string manifest;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      numThreads = atoi(argv[++i]);
+    else
+      manifest = argv[i];
+  }
+  if (manifest.empty()) {
+    fprintf(stderr, "usage: %s [-t threads] <manifest>\n", argv[0]);
+    return 1;
+  }
+
+  Timer total;
+  std::vector<Job> jobs;
+  if (!readManifest(manifest, jobs))
+    return 1;
+  setForceKernel(ForceKernelType::Auto);
+  ThreadPool pool(numThreads);
+
+  // each distinct input once, with the pool
+  Timer t;
+  std::vector<Input> inputs;
+  for (auto& job : jobs) {
+    std::string key = inputKey(job.options);
+    job.input = -1;
+    for (int k = 0; k < (int)inputs.size(); k++)
+      if (inputs[k].key == key)
+        job.input = k;
+    if (job.input >= 0)
+      continue;
+    job.input = (int)inputs.size();
+    inputs.emplace_back();
+    Input& input = inputs.back();
+    input.key = key;
+    if (!job.options.inputFile.empty()) {
+      if (!loadFromFile(job.options.inputFile, input.particles, &pool)) {
+        fprintf(stderr, "line %d: error reading file \"%s\"\n", job.line,
+                job.options.inputFile.c_str());
+        input.failed = true;
+      }
+    } else {
+      generateScene(job.options.scene, job.options.numParticles,
+                    job.options.spaceSize, job.options.seed, input.particles,
+                    &pool);
+    }
+  }
+  double loadTime = t.elapsed();
+
+  // the expected neighbors within the cull radius, for particles spread
+  // over the [-spaceSize, spaceSize]^2 of the scenes
+  double totalCost = 0.0, particleSteps = 0.0;
+  int numSkipped = 0;
+  for (auto& job : jobs) {
+    if (inputs[job.input].failed) {
+      numSkipped++;
+      continue;
+    }
+    double n = (double)inputs[job.input].particles.size();
+    double radius = job.params.cullRadius, side = 2.0 * job.options.spaceSize;
+    double neighbors = side > 0 ? n * 3.14159265 * radius * radius / (side * side) : n;
+    job.cost = n * job.options.numIterations * (1.0 + std::min(neighbors, n));
+    totalCost += job.cost;
+    particleSteps += n * job.options.numIterations;
+  }
+  std::vector<int> large, small;
+  for (int k = 0; k < (int)jobs.size(); k++)
+    if (!inputs[jobs[k].input].failed)
+      (pool.numThreads() > 1 && jobs[k].cost > totalCost / pool.numThreads() ?
+         large : small).push_back(k);
+  auto byCost = [&](int a, int b) { return jobs[a].cost > jobs[b].cost; };
+  std::sort(small.begin(), small.end(), byCost);
+
+  t.reset();
+  for (int k : large)
+    runJob(jobs[k], inputs[jobs[k].input].particles, &pool);
+  double largeTime = t.elapsed();
+  t.reset();
+  std::atomic<int> next(0);
+  pool.parallelFor((uint32_t)pool.numThreads(), 1, [&](uint32_t, uint32_t) {
+    for (int k; (k = next++) < (int)small.size();) {
+      Job& job = jobs[small[k]];
+      runJob(job, inputs[job.input].particles, nullptr);
+    }
+  });
+  double smallTime = t.elapsed();
+  double seconds = total.elapsed();
+
+  int numFailed = 0;
+  for (auto& job : jobs) {
+    if (inputs[job.input].failed) {
+      printf("line %d: skipped, its input could not be read\n", job.line);
+      continue;
+    }
+    if (job.failed) {
+      printf("line %d: failed, its output could not be written\n", job.line);
+      numFailed++;
+      continue;
+    }
+    printf("line %d: %zu particles, %d iterations, cull %g, dt %g -> %s: %.6fs\n",
+           job.line, inputs[job.input].particles.size(),
+           job.options.numIterations, job.params.cullRadius,
+           job.params.deltaTime, job.options.outputFile.c_str(), job.seconds);
+  }
+  printf("%zu jobs on %d threads, %zu distinct inputs loaded in %.6fs; "
+         "%zu jobs on the whole pool in %.6fs, %zu side by side in %.6fs, "
+         "%d skipped, %d failed\n", jobs.size(), pool.numThreads(), inputs.size(),
+         loadTime, large.size(), largeTime, small.size(), smallTime, numSkipped,
+         numFailed);
+  printf("batch: %.0f particle-steps in %.6fs, %.4g particle-steps/s\n",
+         particleSteps, seconds, seconds > 0 ? particleSteps / seconds : 0.0);
+  return numSkipped > 0 || numFailed > 0 ? 1 : 0;
+}
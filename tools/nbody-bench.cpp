@@ -0,0 +1,316 @@
+// Microbenchmarks of the simulation hot paths, without the MPI driver.
+//
+// Every scene in the benchmark directory and a few synthetic uniform
+// scenes are timed for tree construction with both builders, neighbor
+// queries, force evaluation with computeForce and with the force kernel,
+// and a full simulateStep. Each benchmark runs a few warmup rounds and then
+// repeated timed runs, and reports the median, the 95th percentile and the
+// particles processed per second. -json writes the results for tracking.
+//
+// usage: nbody-bench [-dir src/benchmark-files] [-sizes 1000,10000,100000]
+//                    [-repeat 10] [-warmup 2] [-sample 1024] [-t threads]
+//                    [-filter name] [-json results.json]
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include "common.h"
+#include "force-kernel.h"
+#include "quad-tree.h"
+#include "simulate-step.h"
+#include "thread-pool.h"
+#include "timing.h"
+
+struct BenchOptions
+{
+    std::string directory = "src/benchmark-files";
+    std::vector<int> syntheticSizes = { 1000, 10000, 100000 };
+    int repeat = 10;
+    int warmup = 2;
+    // particles whose neighbors the query and force benchmarks evaluate
+    int sample = 1024;
+    int numThreads = 1;
+    std::string filter;
+    std::string jsonFile;
+};
+
+struct BenchResult
+{
+    std::string scene;
+    std::string benchmark;
+    size_t sceneParticles;
+    // particles processed by one run
+    size_t particles;
+    double median, p95, min, mean;
+};
+
+struct Scene
+{
+    std::string name;
+    std::vector<Particle> particles;
+    float spaceSize;
+};
+
+// The benchmark files use a space size of one hundredth of the particle
+// count, see checker.pl.
+static float spaceSizeFor(size_t numParticles)
+{
+  return std::max(1.0f, numParticles / 100.0f);
+}
+
+static std::vector<Scene> loadScenes(const BenchOptions& options)
+{
+  std::vector<std::string> names;
+  if (DIR* dir = opendir(options.directory.c_str())) {
+    const std::string suffix = "-init.txt";
+    while (dirent* entry = readdir(dir)) {
+      std::string file = entry->d_name;
+      if (file.size() > suffix.size() &&
+          file.compare(file.size() - suffix.size(), suffix.size(), suffix) == 0)
+        names.push_back(file.substr(0, file.size() - suffix.size()));
+    }
+    closedir(dir);
+  }
+  std::sort(names.begin(), names.end());
+
+  std::vector<Scene> scenes;
+  for (auto& name : names) {
+    Scene scene;
+    scene.name = name;
+    if (!loadFromFile(options.directory + "/" + name + "-init.txt", scene.particles))
+      continue;
+    scene.spaceSize = spaceSizeFor(scene.particles.size());
+    scenes.push_back(scene);
+  }
+
+  // uniform scenes with the density and speeds of the random-* files
+  for (int size : options.syntheticSizes) {
+    Scene scene;
+    scene.name = "uniform-" + std::to_string(size);
+    scene.spaceSize = spaceSizeFor(size);
+    std::mt19937 rng(size);
+    std::uniform_real_distribution<float> mass(1.0f, 10.0f);
+    std::uniform_real_distribution<float> position(-scene.spaceSize, scene.spaceSize);
+    std::uniform_real_distribution<float> velocity(-scene.spaceSize * 0.5f,
+                                                   scene.spaceSize * 0.5f);
+    scene.particles.resize(size);
+    for (int i = 0; i < size; i++) {
+      Particle& p = scene.particles[i];
+      p.id = i;
+      p.mass = mass(rng);
+      p.position = Vec2(position(rng), position(rng));
+      p.velocity = Vec2(velocity(rng), velocity(rng));
+    }
+    scenes.push_back(scene);
+  }
+
+  if (!options.filter.empty())
+    scenes.erase(std::remove_if(scenes.begin(), scenes.end(), [&](const Scene& s) {
+                   return s.name.find(options.filter) == std::string::npos;
+                 }), scenes.end());
+  return scenes;
+}
+
+// Times warmup + repeat calls of run and summarizes the timed ones.
+template <typename Fn>
+static BenchResult measure(const BenchOptions& options, const Scene& scene,
+                           const char* benchmark, size_t particles, Fn&& run)
+{
+  for (int i = 0; i < options.warmup; i++)
+    run();
+  std::vector<double> times;
+  for (int i = 0; i < std::max(options.repeat, 1); i++) {
+    Timer t;
+    run();
+    times.push_back(t.elapsed());
+  }
+  std::sort(times.begin(), times.end());
+
+  BenchResult result;
+  result.scene = scene.name;
+  result.benchmark = benchmark;
+  result.sceneParticles = scene.particles.size();
+  result.particles = particles;
+  result.median = times[times.size() / 2];
+  result.p95 = times[std::min(times.size() - 1, (size_t)(0.95 * times.size()))];
+  result.min = times.front();
+  result.mean = 0.0;
+  for (double t : times)
+    result.mean += t / times.size();
+  printf("%-18s %-17s %9zu %12.6f %12.6f %14.0f\n", result.scene.c_str(),
+         benchmark, particles, result.median, result.p95,
+         result.median > 0 ? particles / result.median : 0.0);
+  fflush(stdout);
+  return result;
+}
+
+// anything the compiler must not optimize away is added to this
+static volatile float benchSink;
+
+static void benchScene(const BenchOptions& options, const Scene& scene,
+                       ThreadPool& pool, std::vector<BenchResult>& results)
+{
+  const std::vector<Particle>& particles = scene.particles;
+  const size_t n = particles.size();
+  StepParameters params = getBenchmarkStepParams(scene.spaceSize);
+  Vec2 bmin, bmax;
+  computeBounds(particles, bmin, bmax);
+
+  QuadTree tree;
+  results.push_back(measure(options, scene, "build-recursive", n, [&] {
+    buildQuadTree(particles, tree, TreeBuilderType::Recursive, bmin, bmax, &pool);
+  }));
+  results.push_back(measure(options, scene, "build-morton", n, [&] {
+    buildQuadTree(particles, tree, TreeBuilderType::Morton, bmin, bmax, &pool);
+  }));
+
+  // queries and forces are evaluated for an evenly spread sample
+  std::vector<uint32_t> sample;
+  size_t sampleSize = std::min(n, (size_t)std::max(options.sample, 1));
+  for (size_t k = 0; k < sampleSize; k++)
+    sample.push_back((uint32_t)(k * n / sampleSize));
+
+  std::vector<Particle> found;
+  results.push_back(measure(options, scene, "query", sampleSize, [&] {
+    size_t total = 0;
+    for (uint32_t i : sample) {
+      // getParticles appends
+      found.clear();
+      tree.getParticles(found, particles[i].position, params.cullRadius);
+      total += found.size();
+    }
+    benchSink = (float)total;
+  }));
+
+  // the neighbors of the sample, found once for the force benchmarks: as
+  // indices into the tree for computeForce, and gathered into arrays for
+  // the kernel
+  std::vector<uint32_t> neighborBegin(1, 0), neighbors, indices;
+  std::vector<float> positionX, positionY, mass;
+  for (uint32_t i : sample) {
+    tree.getParticleIndices(indices, particles[i].position, params.cullRadius);
+    for (uint32_t j : indices) {
+      neighbors.push_back(j);
+      positionX.push_back(tree.particles[j].position.x);
+      positionY.push_back(tree.particles[j].position.y);
+      mass.push_back(tree.particles[j].mass);
+    }
+    neighborBegin.push_back((uint32_t)neighbors.size());
+  }
+
+  results.push_back(measure(options, scene, "force-scalar", sampleSize, [&] {
+    float sum = 0.0f;
+    for (size_t k = 0; k < sample.size(); k++) {
+      const Particle& pi = particles[sample[k]];
+      Vec2 force = Vec2(0.0f, 0.0f);
+      for (uint32_t j = neighborBegin[k]; j < neighborBegin[k + 1]; j++)
+        force += computeForce(pi, tree.particles[neighbors[j]], params.cullRadius);
+      sum += updateParticle(pi, force, params.deltaTime).position.x;
+    }
+    benchSink = sum;
+  }));
+  results.push_back(measure(options, scene, "force-kernel", sampleSize, [&] {
+    float sum = 0.0f;
+    for (size_t k = 0; k < sample.size(); k++) {
+      const Particle& pi = particles[sample[k]];
+      uint32_t begin = neighborBegin[k];
+      Vec2 force = Vec2(0.0f, 0.0f);
+      accumulateForce(pi, positionX.data() + begin, positionY.data() + begin,
+                      mass.data() + begin, neighborBegin[k + 1] - begin,
+                      params.cullRadius, force);
+      sum += updateParticle(pi, force, params.deltaTime).position.x;
+    }
+    benchSink = sum;
+  }));
+
+  // the query benchmark left the tree of the Morton builder, which is
+  // the same tree
+  std::vector<Particle> newParticles(n);
+  results.push_back(measure(options, scene, "simulate-step", n, [&] {
+    simulateStep(tree, particles, newParticles, params, &pool);
+  }));
+}
+
+static void writeJson(const std::string& fileName, const BenchOptions& options,
+                      const char* kernel, const std::vector<BenchResult>& results)
+{
+  FILE* file = fopen(fileName.c_str(), "w");
+  if (!file) {
+    fprintf(stderr, "error writing file \"%s\"\n", fileName.c_str());
+    return;
+  }
+  fprintf(file, "{\n  \"threads\": %d,\n  \"kernel\": \"%s\",\n"
+          "  \"warmup\": %d,\n  \"repeat\": %d,\n  \"results\": [\n",
+          options.numThreads, kernel, options.warmup, options.repeat);
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult& r = results[i];
+    fprintf(file, "    {\"scene\": \"%s\", \"benchmark\": \"%s\", "
+            "\"scene_particles\": %zu, \"particles\": %zu, "
+            "\"median_s\": %.9f, \"p95_s\": %.9f, \"min_s\": %.9f, "
+            "\"mean_s\": %.9f, \"particles_per_s\": %.1f}%s\n",
+            r.scene.c_str(), r.benchmark.c_str(), r.sceneParticles, r.particles,
+            r.median, r.p95, r.min, r.mean,
+            r.median > 0 ? r.particles / r.median : 0.0,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+}
+
+static std::vector<int> parseSizes(const char* list)
+{
+  std::vector<int> sizes;
+  for (const char* p = list; *p; ) {
+    int size = atoi(p);
+    if (size > 0)
+      sizes.push_back(size);
+    const char* comma = strchr(p, ',');
+    if (!comma)
+      break;
+    p = comma + 1;
+  }
+  return sizes;
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions options;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-dir") == 0)
+      options.directory = argv[i + 1];
+    else if (strcmp(argv[i], "-sizes") == 0)
+      options.syntheticSizes = parseSizes(argv[i + 1]);
+    else if (strcmp(argv[i], "-repeat") == 0)
+      options.repeat = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-warmup") == 0)
+      options.warmup = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-sample") == 0)
+      options.sample = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-t") == 0)
+      options.numThreads = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "-filter") == 0)
+      options.filter = argv[i + 1];
+    else if (strcmp(argv[i], "-json") == 0)
+      options.jsonFile = argv[i + 1];
+    else
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+  }
+
+  const char* kernel = forceKernelName(setForceKernel(ForceKernelType::Auto));
+  ThreadPool pool(options.numThreads);
+  std::vector<Scene> scenes = loadScenes(options);
+  printf("%d threads, %s force kernel, %d warmup and %d timed runs\n",
+         pool.numThreads(), kernel, options.warmup, options.repeat);
+  printf("%-18s %-17s %9s %12s %12s %14s\n", "scene", "benchmark",
+         "particles", "median (s)", "p95 (s)", "particles/s");
+
+  std::vector<BenchResult> results;
+  for (auto& scene : scenes)
+    benchScene(options, scene, pool, results);
+  if (!options.jsonFile.empty())
+    writeJson(options.jsonFile, options, kernel, results);
+  return 0;
+}
@@ -0,0 +1,22 @@
+// Converts particle files between the text format and binary snapshots.
+// The input format is detected from the file, the output format from the
+// name: files ending in ".snap" are written as snapshots.
+#include <cstdio>
+#include <vector>
+#include "common.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <input> <output>\n", argv[0]);
+    return 1;
+  }
+  std::vector<Particle> particles;
+  if (!loadFromFile(argv[1], particles)) {
+    fprintf(stderr, "error reading file \"%s\"\n", argv[1]);
+    return 1;
+  }
+  if (!saveToFile(argv[2], particles))
+    return 1;
+  printf("%zu particles\n", particles.size());
+  return 0;
+}